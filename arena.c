@@ -0,0 +1,133 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <err.h>
+#include <sysexits.h>
+
+// chunk and large block headers are padded to keep objects 16 byte aligned
+#define ARENA_HDR 16
+
+struct arena_chunk
+{
+  struct arena_chunk* next;
+};
+
+struct arena_big
+{
+  struct arena_big* prev;
+  struct arena_big* next;
+};
+
+static int size_class( int64_t n )
+{
+  if ( n <= ARENA_MIN_CLASS )
+    return 0;
+  return 64 - __builtin_clzll( n - 1 ) - 4;
+}
+
+void arena_init( struct arena* a )
+{
+  for ( int i = 0; i < ARENA_CLASSES; ++i )
+    arena_pool_init( &a->cls[i], ARENA_MIN_CLASS << i );
+  a->chunks = 0;
+  a->big = 0;
+  a->chunk_bytes = a->big_bytes = 0;
+}
+
+void arena_free_all( struct arena* a )
+{
+  while ( a->chunks )
+  {
+    struct arena_chunk* next = a->chunks->next;
+    free( a->chunks );
+    a->chunks = next;
+  }
+  while ( a->big )
+  {
+    struct arena_big* next = a->big->next;
+    free( a->big );
+    a->big = next;
+  }
+  arena_init( a );
+}
+
+int64_t arena_round( int64_t n )
+{
+  if ( n <= ARENA_MAX_CLASS )
+    return ARENA_MIN_CLASS << size_class( n );
+  return (n + 15) & ~(int64_t) 15;
+}
+
+void* arena_alloc( struct arena* a, int64_t n )
+{
+  if ( n <= ARENA_MAX_CLASS )
+    return arena_pool_alloc( a, &a->cls[size_class( n )] );
+
+  n = arena_round( n );
+  struct arena_big* b = malloc( ARENA_HDR + n );
+  if ( ! b ) err( EX_OSERR, NULL );
+  b->prev = 0;
+  b->next = a->big;
+  if ( a->big )
+    a->big->prev = b;
+  a->big = b;
+  a->big_bytes += ARENA_HDR + n;
+  return (char*) b + ARENA_HDR;
+}
+
+void arena_release( struct arena* a, void* p, int64_t n )
+{
+  if ( n <= ARENA_MAX_CLASS )
+  {
+    arena_pool_release( &a->cls[size_class( n )], p );
+    return;
+  }
+
+  struct arena_big* b = (struct arena_big*) ((char*) p - ARENA_HDR);
+  if ( b->prev )
+    b->prev->next = b->next;
+  else
+    a->big = b->next;
+  if ( b->next )
+    b->next->prev = b->prev;
+  a->big_bytes -= ARENA_HDR + arena_round( n );
+  free( b );
+}
+
+void arena_pool_init( struct arena_pool* pool, size_t size )
+{
+  pool->size = (size + 15) & ~(size_t) 15;
+  assert( pool->size <= ARENA_CHUNK - ARENA_HDR );
+  pool->free = 0;
+  pool->bump = pool->end = 0;
+}
+
+void* arena_pool_alloc( struct arena* a, struct arena_pool* pool )
+{
+  if ( pool->free )
+  {
+    void* p = pool->free;
+    pool->free = *(void**) p;
+    return p;
+  }
+  if ( pool->end - pool->bump < pool->size )
+  {
+    struct arena_chunk* c = malloc( ARENA_CHUNK );
+    if ( ! c ) err( EX_OSERR, NULL );
+    c->next = a->chunks;
+    a->chunks = c;
+    a->chunk_bytes += ARENA_CHUNK;
+    pool->bump = (char*) c + ARENA_HDR;
+    pool->end = (char*) c + ARENA_CHUNK;
+  }
+  void* p = pool->bump;
+  pool->bump += pool->size;
+  return p;
+}
+
+void arena_pool_release( struct arena_pool* pool, void* p )
+{
+  *(void**) p = pool->free;
+  pool->free = p;
+}
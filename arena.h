@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Memory of a buffer: line data and tree nodes.
+//
+// Small blocks come from size class slabs: chunks of ARENA_CHUNK bytes cut
+// into equally sized objects, freed objects go to a free list of their class
+// and are reused by the next allocation of the class.  There is no per
+// object header, the caller passes the size back to arena_release().
+// Blocks larger than the largest class are malloc'ed with a small list
+// header.  arena_free_all() releases everything in O(number of chunks).
+//
+// Not thread safe, a buffer is only modified by the main thread.
+
+#define ARENA_CHUNK (64 << 10)
+#define ARENA_MIN_CLASS 16   //< smallest block
+#define ARENA_MAX_CLASS 4096 //< largest block from a slab
+#define ARENA_CLASSES 9      //< 16, 32, .., 4096
+
+struct arena_chunk;
+struct arena_big;
+
+// slab of equally sized objects
+struct arena_pool
+{
+  int64_t size; //< bytes per object, multiple of 16
+  void* free;   //< released objects, linked through their first word
+  char* bump;   //< next never used object in the newest chunk
+  char* end;
+};
+
+struct arena
+{
+  struct arena_pool cls[ARENA_CLASSES];
+  struct arena_chunk* chunks; //< all chunks of all pools
+  struct arena_big* big;      //< blocks larger than ARENA_MAX_CLASS
+  int64_t chunk_bytes;        //< bytes of all chunks
+  int64_t big_bytes;          //< bytes of all large blocks
+};
+
+void arena_init( struct arena* a );
+// release all memory of a, a is empty afterwards
+void arena_free_all( struct arena* a );
+
+// usable size of a block allocated for n bytes: the size class or n rounded up
+int64_t arena_round( int64_t n );
+// block of arena_round( n ) bytes
+void* arena_alloc( struct arena* a, int64_t n );
+// give back a block of arena_alloc( n ), n may be anything rounding to the same size
+void arena_release( struct arena* a, void* p, int64_t n );
+
+// pool of fixed size objects whose chunks belong to a
+void arena_pool_init( struct arena_pool* pool, size_t size );
+void* arena_pool_alloc( struct arena* a, struct arena_pool* pool );
+void arena_pool_release( struct arena_pool* pool, void* p );
+
+// bytes taken from the system
+static inline int64_t arena_bytes( const struct arena* a ) { return a->chunk_bytes + a->big_bytes; }
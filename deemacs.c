@@ -1,5 +1,4 @@
 #include <stdio.h>
-#include <curses.h>
 #include <locale.h>
 #include <err.h>
 #include <assert.h>
@@ -12,23 +11,46 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "input.h"
+#include "textbuf.h"
+#include "simd.h"
+#include "search.h"
+#include "keymap.h"
+#include "render.h"
 #include "version.h"
 
 /* Flag set by ‘--verbose’. */
 static int verbose_flag;
+/* Flag set by ‘--index’. */
+static int index_flag;
+/* Set by ‘--input=raw’ and ‘--esc-timeout’. */
+static bool raw_input;
+static int esc_timeout = KBD_ESC_TIMEOUT;
+/* Set by ‘--output=ansi’. */
+static enum render_backend output = RENDER_CURSES;
 
 // file informations
 FILE* f;
 const  char* file_name;
 
-bool has_color;
-
 // buffer content
-char** buf;
-int64_t buf_sz;
-int64_t buf_cap;
+struct textbuf buf;
+
+// key bindings, starts with the bindings below
+struct keymap* keymap;
+
+// number of lines indexed so far, the file may have more
+int64_t buf_sz(void) { return tb_size( &buf ); }
+
+// does line y exist? indexes the file up to line y if required
+bool buf_has_line( int64_t y ) { return y >= 0 && tb_ensure_lines( &buf, y+1 ); }
+
+// like buf_has_line but waits for the background loader to reach line y
+bool buf_wait_line( int64_t y ) { return y >= 0 && tb_wait_lines( &buf, y+1 ); }
 
 // buffer position top left
 int64_t buf_r, buf_c;
@@ -52,36 +74,32 @@ int ncols;
 
 // functions
 
-typedef void (*function_t) (void);
+// commands get the count given with C-u, 1 without
+typedef void (*function_t) ( int64_t n );
 
+// default key bindings, see keymap
 struct Binding
 {
-  int first;
-  int second;
+  int32_t keys[KEYMAP_DEPTH_MAX]; //< key sequence, ends at the first 0
   function_t func;
   const char* description;
 };
 
 void refresh_all(void);
+void redraw(void);
+void damage_lines( int64_t from, int64_t to );
+void damage_from( int64_t r );
+void damage_status(void);
 
 void refresh_status_bar( const char* extra_info );
+void ding(void);
 
 // visual length
 int64_t vlen( int64_t y )
 {
- if ( y >= buf_sz || y < 0 )
+ if ( ! buf_has_line( y ) )
    return 0;
- int64_t res = strlen(buf[y]);
- if ( res > 0 )
- {
-   res -= buf[y][res-1]=='\n';
-   if ( res > 0 )
-   {
-     // because windowz files are special snowflakes
-     res -= buf[y][res-1]=='\r';
-   }
- }
- return res;
+ return line_len( tb_line( &buf, y ) );
 }
 
 
@@ -93,20 +111,24 @@ int64_t vlen( int64_t y )
 // size being more efficient but potentially resulting in large unused memory blocks.
 #define REALLOCF realloc
 
+// commands run at most before the screen is repainted while input is pending
+#define TYPEAHEAD_MAX 4096
+
 int option_show_newlines = 0;
 
 /// >>>> functions begin
 
-static void f_exit(void)
+static void f_exit( int64_t n )
 {
   exit(0);
 }
 
 void write_file(void);
 void refresh_buffer( int64_t starting_from_line );
+static void refresh_rows( int64_t from, int64_t to );
 void add_special_buffer_message( int64_t y, int64_t x, const char* line );
 
-static void f_save(void)
+static void f_save( int64_t n )
 {
   char* tmp = malloc( strlen("saving ") + strlen( file_name ) + 1 );
   *tmp = 0;
@@ -123,65 +145,117 @@ static void f_save(void)
 int try_move_cursor_to_buf_pos( int64_t y, int64_t x, int with_refresh );
 
 
-static void f_isearch_forward(void);
+static void f_isearch_forward( int64_t n );
+static void f_isearch_backward( int64_t n );
+static void f_isearch_forward_regexp( int64_t n );
+static void f_isearch_backward_regexp( int64_t n );
+static void f_replace_string( int64_t n );
+static void f_query_replace( int64_t n );
+static void f_occur( int64_t n );
+
+// move the cursor n columns right (left if n < 0) in one jump, it stays
+// in its line
+static void move_chars( int64_t n )
+{
+  int64_t x = cur_buf_c() + n;
+  if ( x < 0 && cur_buf_c() > 0 )
+    x = 0;
+  if ( try_move_cursor_to_buf_pos( cur_buf_r(), x, 1 ) == 0 )
+    ding();
+}
+
+// move the cursor n lines down (up if n < 0) in one jump, as far as
+// possible if the buffer ends before
+static void move_lines( int64_t n )
+{
+  int64_t y = cur_buf_r() + n;
+  bool ok = true;
+  if ( y < 0 )
+  {
+    y = 0;
+    ok = false;
+  }
+  else if ( n > 0 && ! buf_wait_line( y ) )
+  {
+    y = buf_sz() - 1;
+    ok = false;
+  }
+  if ( y != cur_buf_r() && try_move_cursor_to_buf_pos( y, cur_buf_c_wander(), 1 ) == 0 )
+    ok = false;
+  if ( ! ok )
+    ding();
+}
 
-static void f_forward_char(void) { if ( try_move_cursor_to_buf_pos( cur_buf_r(), cur_buf_c()+1, 1 ) == 0 ) beep(); }
-static void f_backward_char(void) { if ( try_move_cursor_to_buf_pos( cur_buf_r(), cur_buf_c()-1, 1 ) == 0 ) beep(); }
-static void f_next_line(void) { if ( try_move_cursor_to_buf_pos( cur_buf_r()+1, cur_buf_c_wander(), 1 ) == 0 ) beep(); }
-static void f_previous_line(void) { if ( try_move_cursor_to_buf_pos( cur_buf_r()-1, cur_buf_c_wander(), 1 ) == 0 ) beep(); }
-static void f_move_end_of_line(void) { if ( try_move_cursor_to_buf_pos( cur_buf_r(), vlen( cur_buf_r() ), 1 ) == 0 ) beep(); }
-static void f_move_beginning_of_line(void) { if ( try_move_cursor_to_buf_pos( cur_buf_r(), 0, 1 ) == 0 ) beep(); }
-static void f_recenter(void)
+static void f_forward_char( int64_t n ) { move_chars( n ); }
+static void f_backward_char( int64_t n ) { move_chars( -n ); }
+static void f_next_line( int64_t n ) { move_lines( n ); }
+static void f_previous_line( int64_t n ) { move_lines( -n ); }
+static void f_move_end_of_line( int64_t n ) { if ( try_move_cursor_to_buf_pos( cur_buf_r(), vlen( cur_buf_r() ), 1 ) == 0 ) ding(); }
+static void f_move_beginning_of_line( int64_t n ) { if ( try_move_cursor_to_buf_pos( cur_buf_r(), 0, 1 ) == 0 ) ding(); }
+static void f_recenter( int64_t n )
 {
-  if ( buf_sz <= nrows || cur_buf_r() < (nrows / 2) )
+  if ( ! buf_has_line( nrows ) || cur_buf_r() < (nrows / 2) )
     return;
   int64_t old_cur_r = cur_r;
   cur_r = nrows / 2;
   buf_r = buf_r - cur_r + old_cur_r;
-  refresh_all();
+  redraw();
 }
-static void f_page_down(void)
+static void f_page_up( int64_t n );
+// n pages
+static void f_page_down( int64_t n )
 {
+  if ( n < 0 )
+  {
+    f_page_up( -n );
+    return;
+  }
   // emacs adds only nrows-2, we add one more. Emacs also only allows at least 3 rows for a buffer.
   if ( nrows <= 1 )
-    ++buf_r;
+    buf_r += n;
   else
-    buf_r += nrows - 1;
-  if ( buf_r >= buf_sz )
-    buf_r = buf_sz - 1;
-  if ( cur_buf_r() >= buf_sz )
-    cur_r = buf_sz - buf_r - 1;
+    buf_r += n * (nrows - 1);
+  buf_has_line( buf_r + nrows );
+  if ( buf_r >= buf_sz() )
+    buf_r = buf_sz() - 1;
+  if ( cur_buf_r() >= buf_sz() )
+    cur_r = buf_sz() - buf_r - 1;
   try_move_cursor_to_buf_pos( cur_buf_r(), cur_buf_c_wander(), 0 );
-  refresh_all();
+  redraw();
 }
-static void f_page_up(void)
+static void f_page_up( int64_t n )
 {
+  if ( n < 0 )
+  {
+    f_page_down( -n );
+    return;
+  }
   // emacs adds only nrows-2, we add one more. Emacs also only allows at least 3 rows for a buffer.
   if ( nrows <= 1 )
-    --buf_r;
+    buf_r -= n;
   else
-    buf_r -= nrows - 1;
+    buf_r -= n * (nrows - 1);
   if ( buf_r < 0 )
     buf_r = 0;
-  assert( cur_buf_r() <= buf_sz );
+  assert( cur_buf_r() <= buf_sz() );
   try_move_cursor_to_buf_pos( cur_buf_r(), cur_buf_c_wander(), 0 );
-  refresh_all();
+  redraw();
 }
 
-static void f_add_return(void);
+static void f_add_return( int64_t n );
 
-static void f_backspace_function(void);
-static void f_delete_function(void);
+static void f_backspace_function( int64_t n );
+static void f_delete_function( int64_t n );
 
-static void f_keyboard_quit(void) { refresh_all(); beep(); }
+static void f_keyboard_quit( int64_t n ) { refresh_all(); ding(); }
 
-static void f_beginning_of_buffer(void)
+static void f_beginning_of_buffer( int64_t n )
 {
   cur_buf_c_wanderlust = cur_c = cur_r = buf_r = buf_c = 0;
-  refresh_all();
+  redraw();
 }
 
-static void f_option_show_newlines(void)
+static void f_option_show_newlines( int64_t n )
 {
   option_show_newlines = ! option_show_newlines;
   const char* msgon = "set show_newlines to on";
@@ -190,13 +264,24 @@ static void f_option_show_newlines(void)
   refresh_status_bar( option_show_newlines ? msgon : msgoff );
 }
 
-static void f_revert_buffer(void);
+static void f_revert_buffer( int64_t n );
+
+static void f_show_keybindings( int64_t n );
+
+static void f_kill_line( int64_t n );
+
+static void f_go_to_line( int64_t n );
+
+static void f_paste( int64_t n );
 
-static void f_show_keybindings(void);
+static void f_set_mark( int64_t n );
 
-static void f_kill_line(void);
+static void f_universal_argument( int64_t n );
 
-static void f_go_to_line(void);
+static void f_kmacro_start( int64_t n );
+static void f_kmacro_end( int64_t n );
+static void f_kmacro_end_and_call( int64_t n );
+static void f_kmacro_region_lines( int64_t n );
 
 /// <<<< functions end
 
@@ -204,120 +289,202 @@ static void f_go_to_line(void);
 struct Binding bindings[] =
 {
 // movement
-  { 'n' | KBD_CTRL, KBD_NOKEY, f_next_line, "next line" },
-  { 'p' | KBD_CTRL, KBD_NOKEY, f_previous_line, "previous line" },
-  { 'f' | KBD_CTRL, KBD_NOKEY, f_forward_char, "one character forward" },
-  { 'b' | KBD_CTRL, KBD_NOKEY, f_backward_char, "one character backward" },
-  { KBD_DOWN, KBD_NOKEY, f_next_line, "next line" },
-  { KBD_UP, KBD_NOKEY, f_previous_line, "previous line" },
-  { KBD_RIGHT, KBD_NOKEY, f_forward_char, "one character forward" },
-  { KBD_LEFT, KBD_NOKEY, f_backward_char, "one character backward" },
-  { KBD_RET, KBD_NOKEY, f_add_return, "insert return" },
-  { KBD_BS, KBD_NOKEY, f_backspace_function, "backspace" },
-  { KBD_DEL, KBD_NOKEY, f_delete_function, "delete one character" },
-  { 'd' | KBD_CTRL, KBD_NOKEY, f_delete_function, "delete one character" },
+  { { 'n' | KBD_CTRL }, f_next_line, "next line" },
+  { { 'p' | KBD_CTRL }, f_previous_line, "previous line" },
+  { { 'f' | KBD_CTRL }, f_forward_char, "one character forward" },
+  { { 'b' | KBD_CTRL }, f_backward_char, "one character backward" },
+  { { KBD_DOWN }, f_next_line, "next line" },
+  { { KBD_UP }, f_previous_line, "previous line" },
+  { { KBD_RIGHT }, f_forward_char, "one character forward" },
+  { { KBD_LEFT }, f_backward_char, "one character backward" },
+  { { KBD_RET }, f_add_return, "insert return" },
+  { { KBD_BS }, f_backspace_function, "backspace" },
+  { { KBD_DEL }, f_delete_function, "delete one character" },
+  { { 'd' | KBD_CTRL }, f_delete_function, "delete one character" },
 
-  { 'v' | KBD_CTRL, KBD_NOKEY, f_page_down, "move one page down" },
-  { 'v' | KBD_META, KBD_NOKEY, f_page_up, "move one page up" },
+  { { 'v' | KBD_CTRL }, f_page_down, "move one page down" },
+  { { 'v' | KBD_META }, f_page_up, "move one page up" },
 
-  { '<' | KBD_META, KBD_NOKEY, f_beginning_of_buffer, "move to beginning of buffer" },
+  { { '<' | KBD_META }, f_beginning_of_buffer, "move to beginning of buffer" },
 
-  { 'l' | KBD_CTRL, KBD_NOKEY, f_recenter, "center cursor" },
+  { { 'l' | KBD_CTRL }, f_recenter, "center cursor" },
 
-  { 'a' | KBD_CTRL, KBD_NOKEY, f_move_beginning_of_line, "move to beginning of line" },
-  { 'e' | KBD_CTRL, KBD_NOKEY, f_move_end_of_line, "move to end of line" },
+  { { 'a' | KBD_CTRL }, f_move_beginning_of_line, "move to beginning of line" },
+  { { 'e' | KBD_CTRL }, f_move_end_of_line, "move to end of line" },
 
-  { 'o' | KBD_META, 'n', f_option_show_newlines, "option on/off: show newlines" },
+  { { 'o' | KBD_META, 'n' }, f_option_show_newlines, "option on/off: show newlines" },
 
-  { 'u' | KBD_CTRL | KBD_META, KBD_NOKEY, f_revert_buffer, "revert buffer" }, //< this is bound to SUPER-u in emacs
+  { { 'u' | KBD_CTRL | KBD_META }, f_revert_buffer, "revert buffer" }, //< this is bound to SUPER-u in emacs
 
-  { 'x' | KBD_CTRL, 'c' | KBD_CTRL, f_exit, "exit" },
-  { 'x' | KBD_CTRL, 's' | KBD_CTRL, f_save, "save buffer to file" },
+  { { 'x' | KBD_CTRL, 'c' | KBD_CTRL }, f_exit, "exit" },
+  { { 'x' | KBD_CTRL, 's' | KBD_CTRL }, f_save, "save buffer to file" },
 
-  { 's' | KBD_CTRL, KBD_NOKEY, f_isearch_forward, "search forward" },
+  { { 's' | KBD_CTRL }, f_isearch_forward, "search forward" },
+  { { 'r' | KBD_CTRL }, f_isearch_backward, "search backward" },
+  { { 's' | KBD_CTRL | KBD_META }, f_isearch_forward_regexp, "regexp search forward" },
+  { { 'r' | KBD_CTRL | KBD_META }, f_isearch_backward_regexp, "regexp search backward" },
+  { { '%' | KBD_META }, f_query_replace, "query replace" },
+  { { 's' | KBD_META, 'o' }, f_occur, "list matching lines" },
+  { { 's' | KBD_META, 'r' }, f_replace_string, "replace string" },
 
-  { 'g' | KBD_CTRL, KBD_NOKEY, f_keyboard_quit, "exit command" },
+  { { 'g' | KBD_CTRL }, f_keyboard_quit, "exit command" },
+  { { KBD_PASTE }, f_paste, "insert pasted text" },
 
-  { 'g' | KBD_META, 'g', f_go_to_line, "go to line [arg]" },
-  { 'g' | KBD_META, 'g' | KBD_META, f_go_to_line, "go to line [arg]" },
+  { { 'g' | KBD_META, 'g' }, f_go_to_line, "go to line [arg]" },
+  { { 'g' | KBD_META, 'g' | KBD_META }, f_go_to_line, "go to line [arg]" },
 
-  { 'k' | KBD_CTRL, KBD_NOKEY, f_kill_line, "delete until end of line" },
+  { { 'k' | KBD_CTRL }, f_kill_line, "delete until end of line" },
 
-  { 'h' | KBD_CTRL, 'b', f_show_keybindings, "show keybindings" }, //< KBD_CTRL+h is often translated as backspace in terminal
-  { '?' | KBD_META, KBD_NOKEY, f_show_keybindings, "show keybindings" }
+  { { '@' | KBD_CTRL }, f_set_mark, "set mark" }, //< C-SPC
+
+  { { 'u' | KBD_CTRL }, f_universal_argument, "count [arg] for the next command" },
+
+  { { 'x' | KBD_CTRL, '(' }, f_kmacro_start, "start keyboard macro" },
+  { { 'x' | KBD_CTRL, ')' }, f_kmacro_end, "end keyboard macro" },
+  { { 'x' | KBD_CTRL, 'e' }, f_kmacro_end_and_call, "end and call keyboard macro [arg] times" },
+  { { 'x' | KBD_CTRL, 'k' | KBD_CTRL, 'r' }, f_kmacro_region_lines, "call keyboard macro on each line of region" },
+
+  { { 'h' | KBD_CTRL, 'b' }, f_show_keybindings, "show keybindings" }, //< KBD_CTRL+h is often translated as backspace in terminal
+  { { '?' | KBD_META }, f_show_keybindings, "show keybindings" }
 }
 ;
 
-void cleanup_at_exit(void)
+static void init_keymap(void)
 {
-  endwin();
+  keymap = keymap_new();
+  for ( int i = 0; i < sizeof(bindings) / sizeof(bindings[0]); ++i )
+  {
+    struct Binding* tmp = &bindings[i];
+    int n = 0;
+    while ( n < KEYMAP_DEPTH_MAX && tmp->keys[n] )
+      ++n;
+    keymap_bind( keymap, tmp->keys, n, tmp->func, tmp->description );
+  }
 }
 
-void cleanup( int eval )
+void free_buffer(void);
+
+// pasted text is marked by the terminal, see deemacs_paste_text()
+static bool bracketed_paste;
+
+static void set_bracketed_paste( bool on )
 {
-  endwin();
+  if ( on == bracketed_paste )
+    return;
+  bracketed_paste = on;
+  printf( on ? "\033[?2004h" : "\033[?2004l" );
+  fflush( stdout );
 }
 
-void debug_print_buf(void);
+// with --verbose, how much the output backend wrote to compare them
+static void print_render_stats(void)
+{
+  struct render_stats st;
+  render_stats( &st );
+  if ( st.frames == 0 )
+    return;
+  if ( st.bytes >= 0 )
+    fprintf( stderr, "deemacs: %s output: %" PRId64 " frames, %" PRId64 " bytes, %.1f bytes and %.3f ms per frame\n",
+             render_name(), st.frames, st.bytes, (double) st.bytes / st.frames, st.time_ns / 1e6 / st.frames );
+  else
+    fprintf( stderr, "deemacs: %s output: %" PRId64 " frames, %.3f ms per frame\n",
+             render_name(), st.frames, st.time_ns / 1e6 / st.frames );
+}
+
+void cleanup_at_exit(void)
+{
+  set_bracketed_paste( false );
+  render_end();
+  if ( verbose_flag )
+    print_render_stats();
+  free_buffer();
+  keymap_free( keymap );
+  keymap = 0;
+}
 
-const int64_t INIT_VEC_SIZE = 16;
-int64_t vec_next_size( int64_t v )
+void cleanup( int eval )
 {
-  return v*2 < INIT_VEC_SIZE ? INIT_VEC_SIZE : v*2;
+  set_bracketed_paste( false );
+  render_end();
 }
 
+void debug_print_buf(void);
+
 void write_file(void)
 {
+  // unedited lines still point into the memory image of the file
+  if ( tb_detach( &buf ) != 0 ) err( EX_OSERR, "%s", file_name );
   f = fopen( file_name, "w+" );
   if ( ! f ) err( EX_IOERR, "%s", file_name );
-  for ( int64_t i = 0; i < buf_sz; ++i )
+  struct tb_iter it;
+  for ( tb_iter_at( &buf, 0, &it ); tb_iter_valid( &it ); tb_iter_next( &it ) )
   {
-    int64_t num_chars = strlen(buf[i]);
-    if ( fwrite( buf[i], 1, num_chars, f ) < num_chars )
+    const struct line* line = tb_iter_line( &it );
+    if ( fwrite( line_data( line ), 1, line_len( line ), f ) < line_len( line ) )
+      err( EX_IOERR, "%s", file_name );
+    if ( line->eol != EOL_NONE && fwrite( line_eol_str( line ), 1, line_eol_len( line ), f ) < line_eol_len( line ) )
       err( EX_IOERR, "%s", file_name );
   }
   if ( fclose( f ) != 0 ) err( EX_IOERR, "%s", file_name );
 }
 
-//// buffer modification functions
-void add_to_buf( char* s, int64_t line_num )
+// the mark, line -1 if not set
+int64_t mark_r = -1, mark_c;
+
+// buffer lines that move along when lines are inserted or removed before
+// them, like the mark
+#define MARKERS_MAX 4
+static int64_t* markers[MARKERS_MAX] = { &mark_r };
+static int nmarkers = 1;
+
+static void add_marker( int64_t* r )
 {
-  if ( buf_sz == buf_cap )
+  assert( nmarkers < MARKERS_MAX );
+  markers[nmarkers++] = r;
+}
+
+static void remove_marker( int64_t* r )
+{
+  for ( int i = 0; i < nmarkers; ++i )
   {
-    buf_cap = vec_next_size( buf_cap );
-    buf = realloc( buf, buf_cap*sizeof(void*) );
-    if ( ! buf ) err( EX_OSERR, "" );
+    if ( markers[i] == r )
+      markers[i] = markers[--nmarkers];
   }
-  // capacity is good enough
-  if ( line_num + 1 < buf_sz )
+}
+
+// n lines were inserted before line r, or -n lines removed starting at it
+static void move_markers( int64_t r, int64_t n )
+{
+  for ( int i = 0; i < nmarkers; ++i )
   {
-    // shift
-    memmove( buf + line_num + 1, buf + line_num, (buf_sz - line_num)*sizeof(void*) );
+    int64_t* m = markers[i];
+    if ( *m >= r )
+      *m = n >= 0 || *m >= r - n ? *m + n : r;
   }
-  ++buf_sz;
-  buf[ line_num ] = s;
 }
-void append_to_buf( char* s )
+
+//// buffer modification functions
+void add_to_buf( const struct line* l, int64_t line_num )
 {
-  add_to_buf( s, buf_sz );
+  tb_insert_line( &buf, line_num, l );
+  move_markers( line_num, 1 );
+  damage_from( line_num );
+}
+void append_to_buf( const struct line* l )
+{
+  add_to_buf( l, buf_sz() );
 }
 void remove_line_from_buf( int64_t line_num )
 {
-  free( buf[line_num] );
-  if ( line_num + 1 < buf_sz )
-  {
-    memmove( buf + line_num, buf + line_num + 1, (buf_sz - line_num - 1)*sizeof(void*) );
-  }
-  --buf_sz;
+  tb_remove_lines( &buf, line_num, 1 );
+  move_markers( line_num, -1 );
+  damage_from( line_num );
 }
 
 void free_buffer(void)
 {
-  for ( int64_t i = 0; i < buf_sz; ++i )
-    free( buf[i] );
-  free( buf );
-  buf_sz = 0;
-  buf_cap = 0;
+  tb_free( &buf );
+  mark_r = -1;
   buf_r = 0;
   buf_c = 0;
   cur_r = 0;
@@ -325,8 +492,9 @@ void free_buffer(void)
 }
 
 void open_file( bool create_if_not_exists );
+void on_idle_while_loading(void);
 
-static void f_revert_buffer(void)
+static void f_revert_buffer( int64_t n )
 {
   free_buffer();
   open_file( 0 );
@@ -334,155 +502,256 @@ static void f_revert_buffer(void)
 }
 
 
-// pos==1 => delete first char in line. pos==0 => delete newline from previous line
-void remove_char_from_buf( int64_t line_num, int64_t pos )
+// the position n characters after line r column c, a line ending counts as
+// one character, false if the buffer ends before
+static bool pos_forward( int64_t* r, int64_t* c, int64_t n )
 {
-  int64_t len = strlen( buf[line_num] );
-  assert( pos <= len );
-  if ( pos > 0 )
+  while ( n > vlen( *r ) - *c )
   {
-    // ez
-    memmove( buf[line_num] + pos - 1, buf[line_num] + pos, len-pos+1 );
-    buf[line_num] = REALLOCF( buf[line_num], len-1+1 );
+    n -= vlen( *r ) - *c + 1;
+    if ( ! buf_wait_line( *r + 1 ) )
+      return false;
+    ++*r;
+    *c = 0;
   }
-  else
+  *c += n;
+  return true;
+}
+
+// the position n characters before line r column c, false if the buffer
+// starts after it
+static bool pos_backward( int64_t* r, int64_t* c, int64_t n )
+{
+  while ( n > *c )
   {
-    // collapse two rows
-    if ( line_num == 0 )
-      return;
-    int64_t len2 = strlen( buf[line_num-1] );
-    buf[line_num-1] = realloc( buf[line_num-1], len + len2 ); //< one newline will be removed
-    memcpy( buf[line_num-1] + len2 - 1, buf[line_num], len + 1 );
-    remove_line_from_buf( line_num );
+    if ( *r == 0 )
+      return false;
+    n -= *c + 1;
+    --*r;
+    *c = vlen( *r );
   }
+  *c -= n;
+  return true;
 }
 
-static void f_kill_line(void)
+// delete from line r1 column c1 up to line r2 column c2, the lines between
+// are removed at once
+void remove_range_from_buf( int64_t r1, int64_t c1, int64_t r2, int64_t c2 )
 {
-  int64_t c = cur_buf_c();
-  int64_t r = cur_buf_r();
-  int64_t len = strlen( buf[r] );
-
-  if ( c+1 == len )
+  struct line* first = tb_line_mut( &buf, r1 );
+  if ( r1 == r2 )
   {
-    f_delete_function();
+    line_erase( &buf, first, c1, c2 - c1 );
+    damage_lines( r1, r1 + 1 );
     return;
   }
-  buf[r][c]='\n';
-  buf[r][c+1]=0;
-  refresh_all();
+  // the rest of the last line replaces the rest of the first one
+  const struct line* last = tb_line( &buf, r2 );
+  line_truncate( first, c1 );
+  line_insert( &buf, first, c1, line_data( last ) + c2, line_len( last ) - c2 );
+  first->eol = last->eol;
+  tb_remove_lines( &buf, r1 + 1, r2 - r1 );
+  move_markers( r1 + 1, r1 - r2 );
+  damage_from( r1 );
 }
 
-static void f_show_keybindings(void)
+// without count delete until the end of the line, or the line ending if
+// there is nothing else, with count n delete n whole lines
+static void f_kill_line( int64_t n )
 {
-  for ( int i = 0; i < sizeof(bindings) / sizeof(bindings[0]); ++i )
-  {
-    struct Binding* tmp = &bindings[i];
-    int32_t first_key = tmp->first;
-    int32_t second_key = tmp->second;
+  int64_t c = cur_buf_c();
+  int64_t r = cur_buf_r();
+  struct line* line = tb_line_mut( &buf, r );
 
-    char to_print[256];
-    to_print[0] = 0;
-    char* tmp1 = deemacs_key_to_str_representation( first_key );
-    strcat( to_print, tmp1 );
-    free(tmp1);
+  if ( n == 1 && c == line_len( line ) )
+  {
+    f_delete_function( 1 );
+    return;
+  }
+  if ( n == 1 )
+  {
+    line_truncate( line, c );
+    damage_lines( r, r + 1 );
+    return;
+  }
 
-    if ( second_key != KBD_NOKEY )
+  // up to the beginning of line r+n, or the end of the buffer
+  int64_t r2 = r, c2 = 0;
+  if ( n > 0 )
+  {
+    r2 = r + n;
+    if ( ! buf_wait_line( r2 ) )
     {
-      char* tmp = deemacs_key_to_str_representation( second_key );
-      strcat( to_print, " ");
-      strcat( to_print, tmp);
-      free( tmp );
+      r2 = buf_sz() - 1;
+      c2 = vlen( r2 );
     }
+    remove_range_from_buf( r, c, r2, c2 );
+  }
+  else
+  {
+    r2 = r + n > 0 ? r + n : 0;
+    remove_range_from_buf( r2, 0, r, c );
+    try_move_cursor_to_buf_pos( r2, 0, 0 );
+  }
+  damage_status();
+}
 
-    int left_col_start = 24;
-    for (int i=strlen(to_print); i<left_col_start; ++i )
-    {
-      to_print[i]=' ';
-      to_print[i+1]=0;
-    }
+// names of the n keys like "C-x C-s", out must have room for
+// KEYMAP_DEPTH_MAX * KBD_STR_MAX chars
+static void keys_to_str( const int32_t* keys, int n, char* out )
+{
+  *out = 0;
+  for ( int i = 0; i < n; ++i )
+  {
+    if ( i > 0 )
+      strcat( out, " " );
+    deemacs_key_to_str( keys[i], out + strlen( out ) );
+  }
+}
 
-    strcat( to_print, tmp->description );
+static void show_binding( void* ctx, const int32_t* keys, int n, const struct keymap_entry* e )
+{
+  int* row = ctx;
+  char to_print[KEYMAP_DEPTH_MAX * KBD_STR_MAX + 256];
+  keys_to_str( keys, n, to_print );
 
-    add_special_buffer_message(i, 0, to_print);
+  int left_col_start = 24;
+  for (int i=strlen(to_print); i<left_col_start; ++i )
+  {
+    to_print[i]=' ';
+    to_print[i+1]=0;
   }
 
+  strncat( to_print, e->description ? e->description : "", 255 );
+
+  add_special_buffer_message( (*row)++, 0, to_print );
 }
 
-void f_backspace_function(void)
+static void f_show_keybindings( int64_t n )
 {
-  int64_t c = cur_buf_c();
-  int64_t r = cur_buf_r();
-  if ( c != 0 )
-  {
-    remove_char_from_buf( cur_buf_r(), cur_buf_c() );
-    --cur_c;
-  }
-  else if ( r != 0 )
+  int row = 0;
+  keymap_walk( keymap, show_binding, &row );
+}
+
+// delete n characters before the cursor, a line ending is one character
+void f_backspace_function( int64_t n )
+{
+  if ( n < 0 )
   {
-    int64_t pos = strlen( buf[r-1] );
-    remove_char_from_buf( cur_buf_r(), cur_buf_c() );
-    --cur_r;
-    cur_c = pos - 1; //< -1 cause of newline
+    f_delete_function( -n );
+    return;
   }
-  else
+  int64_t r = cur_buf_r(), c = cur_buf_c();
+  if ( n == 0 )
+    return;
+  if ( ! pos_backward( &r, &c, n ) )
   {
-    beep();
+    ding();
     return;
   }
-  refresh_all();
+  remove_range_from_buf( r, c, cur_buf_r(), cur_buf_c() );
+  try_move_cursor_to_buf_pos( r, c, 0 );
 }
 
-void f_delete_function(void)
+// delete n characters at the cursor, a line ending is one character
+void f_delete_function( int64_t n )
 {
-  int64_t c = cur_buf_c();
-  int64_t r = cur_buf_r();
-  int64_t len = strlen( buf[r] );
-  if ( c < len-1 )
-  {
-    ++cur_c;
-    f_backspace_function();
-  }
-  else if ( r + 1 < buf_sz )
+  if ( n < 0 )
   {
-    cur_c = 0;
-    ++cur_r;
-    f_backspace_function();
+    f_backspace_function( -n );
+    return;
   }
-  else
+  int64_t r = cur_buf_r(), c = cur_buf_c();
+  if ( n == 0 )
+    return;
+  if ( ! pos_forward( &r, &c, n ) )
   {
-    beep();
+    ding();
     return;
   }
-  refresh_all();
+  remove_range_from_buf( cur_buf_r(), cur_buf_c(), r, c );
+  damage_status();
 }
 
 void add_char_to_buf( char c, int64_t line_num, int64_t pos )
 {
-  int64_t len = strlen( buf[line_num] );
-  buf[line_num] = realloc( buf[line_num], len + 1 + 1 );
-  memmove( buf[line_num] + pos +1, buf[line_num] + pos, len-pos+1 );
-  buf[line_num][pos]=c;
+  line_insert( &buf, tb_line_mut( &buf, line_num ), pos, &c, 1 );
+  damage_lines( line_num, line_num + 1 );
 }
 
 void add_newline_to_buf( int64_t line_num, int64_t pos )
 {
-  char* line = buf[line_num];
-  int64_t len = strlen( line );
-  char* second = malloc( len - pos + 1 );
-  memcpy( second, line+pos, len - pos + 1 );
-  char* first = REALLOCF( buf[line_num], pos + 2 );
-  *(first+pos) = '\n';
-  *(first+pos+1) = 0;
-  buf[line_num] = first;
-  add_to_buf( first, line_num );
-  buf[line_num+1] = second;
+  struct line* first = tb_line_mut( &buf, line_num );
+  struct line second = { 0 };
+  line_insert( &buf, &second, 0, line_data( first ) + pos, line_len( first ) - pos );
+  second.eol = first->eol;
+  line_truncate( first, pos );
+  if ( first->eol == EOL_NONE )
+  {
+    // split the last line, continue the line ending style of the file
+    first->eol = line_num > 0 ? tb_line( &buf, line_num-1 )->eol : EOL_LF;
+  }
+  add_to_buf( &second, line_num+1 );
 }
 
 
+// insert the n bytes at s before column pos of line line_num, the lines
+// of s are split off and inserted at once
+// Returns the line and column behind the inserted text.
+void insert_text_to_buf( int64_t line_num, int64_t pos, const char* s, int64_t n, int64_t* end_r, int64_t* end_c )
+{
+  struct line* first = tb_line_mut( &buf, line_num );
+  const char* nl = memchr( s, '\n', n );
+  if ( ! nl )
+  {
+    line_insert( &buf, first, pos, s, n );
+    damage_lines( line_num, line_num + 1 );
+    *end_r = line_num;
+    *end_c = pos + n;
+    return;
+  }
+
+  // the new lines continue the line ending style of the file
+  enum line_eol eol = first->eol;
+  enum line_eol new_eol = eol != EOL_NONE ? eol : line_num > 0 ? tb_line( &buf, line_num-1 )->eol : EOL_LF;
+  int64_t nlines = 0;
+  for ( const char* p = nl; p; p = memchr( p + 1, '\n', s + n - p - 1 ) )
+    ++nlines;
+  struct line* lines = calloc( nlines, sizeof(struct line) );
+  if ( ! lines ) err( EX_OSERR, NULL );
+
+  // the rest of the first line goes behind the last inserted line
+  struct line* last = &lines[nlines-1];
+  const char* tail = s + n;
+  while ( tail > s && tail[-1] != '\n' )
+    --tail;
+  line_reserve( &buf, last, s + n - tail + line_len( first ) - pos );
+  line_insert( &buf, last, 0, tail, s + n - tail );
+  line_insert( &buf, last, line_len( last ), line_data( first ) + pos, line_len( first ) - pos );
+  last->eol = eol;
+  *end_c = s + n - tail;
+
+  line_truncate( first, pos );
+  line_insert( &buf, first, pos, s, nl - s );
+  first->eol = new_eol;
+  const char* p = nl + 1;
+  for ( int64_t i = 0; i + 1 < nlines; ++i )
+  {
+    const char* e = memchr( p, '\n', s + n - p );
+    line_assign( &buf, &lines[i], p, e - p );
+    lines[i].eol = new_eol;
+    p = e + 1;
+  }
+  tb_insert_lines( &buf, line_num + 1, lines, nlines );
+  move_markers( line_num + 1, nlines );
+  free( lines );
+  damage_from( line_num );
+  *end_r = line_num + nlines;
+}
+
 int try_move_cursor_to_buf_pos( int64_t y, int64_t x, int with_refresh )
 {
-  if ( y < 0 || y >= buf_sz || x < 0 )
+  if ( ! buf_has_line( y ) || x < 0 )
     return 0;
 
   cur_buf_c_wanderlust = x;
@@ -503,48 +772,41 @@ int try_move_cursor_to_buf_pos( int64_t y, int64_t x, int with_refresh )
     // finished - only move required
     cur_r = ydiff;
     cur_c = xdiff;
-    move( cur_r, cur_c );
-    refresh_status_bar(0);
+    render_move( cur_r, cur_c );
+    damage_status();
     return 1;
   }
 
   // cursor does not fit on display - we need to change buf_r/buf_c
+  // The line or column of the cursor is centered like in emacs.
 
-  if ( ydiff < 0 )
+  if ( ydiff < 0 || ydiff >= nrows )
   {
     // lines fit all into screen
-    if ( nrows >= buf_sz )
-    {
+    if ( ydiff < 0 && ! buf_has_line( nrows ) )
       buf_r = 0;
-      cur_r = 0;
-    }
     else
     {
       buf_r = y - nrows/2;
       if ( buf_r < 0 )
         buf_r = 0;
-      cur_r = y - buf_r;
     }
   }
-  else if ( ydiff >= nrows )
+  if ( xdiff < 0 || xdiff >= ncols )
   {
-    buf_r = y - nrows/2;
-    if ( buf_r < 0 )
-      buf_r = 0;
-    cur_r = y - buf_r;
+    // columns that fit into the screen are shown without scrolling
+    if ( x < ncols )
+      buf_c = 0;
+    else
+      buf_c = x - ncols/2;
   }
+  cur_r = y - buf_r;
+  cur_c = x - buf_c;
 
   if (with_refresh) {
-    refresh_all();
+    redraw();
   }
 
-/*
-  if ( xdiff < 0 )
-  {
-    xdiff = 0;
-  }
-  else if ( xdiff > 
-*/
   return 1;
 }
 
@@ -558,31 +820,29 @@ void open_file( bool create_if_not_exists )
     f = fopen( file_name, "w+" );
   }
   if ( ! f ) err( EX_NOINPUT, "%s", file_name );
-  buf = realloc( buf, sizeof(char*) * INIT_VEC_SIZE );
-  buf_sz = 0;
-  buf_cap = INIT_VEC_SIZE;
-  char * tmp_ptr = 0;
-  size_t lcap = 0;
-  while ( 1 )
-  {
-    if ( getline( &tmp_ptr, &lcap, f ) == -1 )
-    {
-      if ( errno ) err( EX_IOERR, "%s", file_name );
-      else break;
-    }
-    append_to_buf( tmp_ptr );
-    tmp_ptr = 0;
-  }
-  tmp_ptr = malloc(1);
-  tmp_ptr[0] = 0;
-  append_to_buf( tmp_ptr );
+  // the mapping stays valid after the file is closed
+  if ( tb_open( &buf, fileno( f ) ) != 0 ) err( EX_IOERR, "%s", file_name );
+  // index the first screen right away, the rest in the background
+  tb_ensure_lines( &buf, 1 );
+  tb_load_async( &buf );
+  if ( ! buf.complete )
+    deemacs_set_idle_hook( on_idle_while_loading, 100 );
+  if ( index_flag )
+    tb_index_trigrams( &buf, fileno( f ), file_name );
   if ( fclose( f ) != 0 ) err( EX_IOERR, "%s", file_name );
 }
 
 void debug_print_buf(void)
 {
-  for ( int i =0; i<buf_sz; ++i )
-    fwrite( buf[i], 1, strlen(buf[i]), stdout );
+  tb_index_all( &buf );
+  struct tb_iter it;
+  for ( tb_iter_at( &buf, 0, &it ); tb_iter_valid( &it ); tb_iter_next( &it ) )
+  {
+    const struct line* line = tb_iter_line( &it );
+    fwrite( line_data( line ), 1, line_len( line ), stdout );
+    if ( line->eol != EOL_NONE )
+      fwrite( line_eol_str( line ), 1, line_eol_len( line ), stdout );
+  }
 }
 
 void editor(void);
@@ -595,17 +855,29 @@ const char* deemacs_license_suffix = "\ndeemacs comes with ABSOLUTELY NO WARRANT
 
 const char* usage_string = "usage: deemacs [ FILE | --file=FILE | -f FILE]\n"
                   "                        [--create=FILE | -c FILE ]\n"
+                  "                        [--index] [--input=curses|raw] [--esc-timeout=MS]\n"
+                  "                        [--output=curses|ansi]\n"
                   "                        [--version | -v] [--verbose] [--help | -h]\n"
   "\n"
   "FILE                       open FILE\n"
   "--create FILE              create FILE if not exists and open\n"
+  "--index                    index large files for repeated searches, cached\n"
+  "                           in ~/.cache/deemacs\n"
+  "--input=raw                read the terminal directly instead of through\n"
+  "                           curses, with a short ESC timeout\n"
+  "--esc-timeout MS           wait MS milliseconds after ESC for the rest of an\n"
+  "                           escape sequence with --input=raw, default 50\n"
+  "--output=ansi              draw with escape sequences, only sending what\n"
+  "                           changed, instead of through curses, implies\n"
+  "                           --input=raw\n"
   "--help                     print help message\n"
   "--version                  print version information\n"
-  "--verbose                  be more verbose";
+  "--verbose                  be more verbose, print output statistics at exit";
 
 int main( int argn, char** argv )
 {
   setlocale(LC_ALL, "");
+  simd_init();
 #ifdef __APPLE__
   err_set_exit( cleanup );
 #endif
@@ -617,12 +889,16 @@ int main( int argn, char** argv )
   static struct option long_options[] =
     {
       {"verbose", no_argument,       &verbose_flag, 1},
+      {"index",   no_argument,       &index_flag, 1},
       /* These options don’t set a flag.
          We distinguish them by their indices. */
       {"create",  required_argument, 0, 'c'},
       {"help",    no_argument,       0, 'h'},
       {"version", no_argument,       0, 'v'},
       {"file",    required_argument, 0, 'f'},
+      {"input",   required_argument, 0, 'i'},
+      {"esc-timeout", required_argument, 0, 'e'},
+      {"output",  required_argument, 0, 'o'},
       {0, 0, 0, 0}
     };
 
@@ -632,6 +908,8 @@ int main( int argn, char** argv )
   {
     switch (c)
     {
+    case 0: //< flag options like --verbose
+      break;
     case 'h':
       errx( 0, "%s", usage_string );
       break;
@@ -641,6 +919,31 @@ int main( int argn, char** argv )
       ++num_files;
       file_name = optarg;
       break;
+    case 'i':
+      if ( strcmp( optarg, "raw" ) == 0 )
+        raw_input = true;
+      else if ( strcmp( optarg, "curses" ) == 0 )
+        raw_input = false;
+      else
+        errx( EX_USAGE, "%s", usage_string );
+      break;
+    case 'o':
+      if ( strcmp( optarg, "ansi" ) == 0 )
+        output = RENDER_ANSI;
+      else if ( strcmp( optarg, "curses" ) == 0 )
+        output = RENDER_CURSES;
+      else
+        errx( EX_USAGE, "%s", usage_string );
+      break;
+    case 'e':
+    {
+      char* end;
+      long ms = strtol( optarg, &end, 10 );
+      if ( *optarg == 0 || *end != 0 || ms < 0 || ms > 60000 )
+        errx( EX_USAGE, "%s", usage_string );
+      esc_timeout = ms;
+      break;
+    }
     case 'v':
       printf( "%s%s%s%s", "deemacs ", deemacs_version,
             "\nCopyright (C) 2016 Jonathan Dees.",
@@ -670,237 +973,406 @@ int main( int argn, char** argv )
 
   editor();
 
-  endwin();
+  render_end();
   cleanup(0);
   return 0;
 }
 
+// What changed on the screen since the last redraw().  Edits mark the
+// buffer lines they change and the main loop repaints only those rows, so
+// typing does not redraw the whole screen.  Scrolling or a resize of the
+// terminal repaint everything.
+struct damage
+{
+  int64_t from, to;     //< buffer lines to repaint, none if from >= to
+  bool status;          //< the status bar
+  bool full;            //< all rows
+  bool overlay;         //< something is drawn over the buffer, see add_special_buffer_message()
+  bool hidden;          //< nothing is drawn while a keyboard macro plays
+  int64_t buf_r, buf_c; //< scroll position of the last repaint
+};
+
+static struct damage damage = { 0, 0, true, true, false, false, -1, -1 };
+
+void damage_lines( int64_t from, int64_t to )
+{
+  if ( damage.from >= damage.to )
+  {
+    damage.from = from;
+    damage.to = to;
+    return;
+  }
+  if ( from < damage.from ) damage.from = from;
+  if ( to > damage.to ) damage.to = to;
+}
+
+// line r changed and the lines after it moved
+void damage_from( int64_t r )
+{
+  damage_lines( r, INT64_MAX );
+}
+
+void damage_status(void)
+{
+  damage.status = true;
+}
+
 void add_special_buffer_message( int64_t y, int64_t x, const char* line )
 {
-  if ( has_color ) attron(COLOR_PAIR(2));
-  attron(A_STANDOUT);
+  if ( damage.hidden )
+    return;
+  render_attron( RENDER_COLOR(2) | RENDER_STANDOUT );
   if ( y <= nrows )
-    mvaddstr( y, x, line );
-  attroff(A_STANDOUT);
-  if ( has_color ) attroff(COLOR_PAIR(2));
+    render_mvaddstr( y, x, line );
+  damage.overlay = true;
+  render_attroff( RENDER_COLOR(2) | RENDER_STANDOUT );
 }
 
+// extra info currently shown in the status bar, kept for redraws
+static char status_extra_info[256];
+
 void refresh_status_bar( const char* extra_info )
 {
+  if ( extra_info != status_extra_info )
+    snprintf( status_extra_info, sizeof(status_extra_info), "%s", extra_info ? extra_info : "" );
+  damage.status = damage.hidden;
+  if ( damage.hidden )
+    return;
   if ( nrows < 0 )
     return;
-  if ( has_color ) attron(COLOR_PAIR(1));
-  attron(A_BOLD);
-  mvaddstr( nrows, 1, file_name );
-  attroff(A_BOLD);
-  if ( has_color ) attroff(COLOR_PAIR(1));
+  render_attron( RENDER_COLOR(1) | RENDER_BOLD );
+  render_mvaddstr( nrows, 1, file_name );
+  render_attroff( RENDER_COLOR(1) | RENDER_BOLD );
 
-  printw( "    %d%%  (%d/%d,%d/%d)", (buf_r)*100/buf_sz, cur_buf_r()+1, buf_sz, cur_buf_c(), strlen(buf[cur_buf_r()]) );
+  // the line count is only a lower bound until the whole file is indexed
+  render_printw( "    %" PRId64 "%%  (%" PRId64 "/%" PRId64 "%s,%" PRId64 "/%" PRId64 ")", (buf_r)*100/buf_sz(), cur_buf_r()+1, buf_sz(), buf.complete ? "" : "+", cur_buf_c(), vlen( cur_buf_r() ) );
+  if ( ! buf.complete )
+    render_printw( "  loading %d%%", (int) (tb_load_progress( &buf ) * 100) );
 
-  clrtoeol();
+  render_clrtoeol();
 
   if ( extra_info && *extra_info != 0 )
   {
     int elen = strlen( extra_info );
     int xpos = ncols - elen - 1;
     if ( xpos < 0 ) xpos = 0;
-    if ( has_color ) attron(COLOR_PAIR(2));
-    attron(A_STANDOUT);
-    mvaddstr( nrows, xpos, extra_info );
-    attroff(A_STANDOUT);
-    if ( has_color ) attroff(COLOR_PAIR(2));
+    render_attron( RENDER_COLOR(2) | RENDER_STANDOUT );
+    render_mvaddstr( nrows, xpos, extra_info );
+    render_attroff( RENDER_COLOR(2) | RENDER_STANDOUT );
   }
   
-  clrtoeol();
-  move( cur_r, cur_c );
+  render_clrtoeol();
+  render_move( cur_r, cur_c );
 }
 
-void refresh_buffer( int64_t starting_from_line )
+// draw the screen rows from .. to-1
+static void refresh_rows( int64_t from, int64_t to )
 {
-  int64_t i = starting_from_line;
-  for ( ; i < nrows && (i+buf_r) < buf_sz; ++i )
+  int64_t i = from;
+  buf_has_line( buf_r + to );
+  struct tb_iter it;
+  for ( tb_iter_at( &buf, buf_r+i, &it ); i < to && tb_iter_valid( &it ); ++i, tb_iter_next( &it ) )
   {
-    if ( i + buf_r > buf_sz )
-      break;
-    int64_t slen = strlen(buf[buf_r+i]);
-    if ( buf_c > slen ) continue;
+    const struct line* line = tb_iter_line( &it );
+    int64_t slen = line_len( line );
+    if ( buf_c > slen )
+    {
+      render_move( i, 0 );
+      render_clrtoeol();
+      continue;
+    }
+    // only the visible slice, the line is never touched
     if ( slen - buf_c > ncols )
     {
-      char tmp = buf[buf_r+i][buf_c+ncols];
-      buf[buf_r+i][buf_c+ncols] = 0;
-      mvaddstr( i, 0, buf[buf_r+i] );
-      buf[buf_r+i][buf_c+ncols] = tmp;
+      render_mvaddnstr( i, 0, line_data( line ) + buf_c, ncols );
     }
     else
     {
-      mvaddstr( i, 0, buf[buf_r+i] );
-      if ( option_show_newlines )
+      render_mvaddnstr( i, 0, line_data( line ) + buf_c, slen - buf_c );
+      if ( option_show_newlines && line->eol != EOL_NONE && slen - buf_c < ncols )
       {
-        if ( has_color ) attron(COLOR_PAIR(3));
-        mvaddstr( i, slen-1, " " );
-        if ( has_color ) attroff(COLOR_PAIR(3));
+        render_attron( RENDER_COLOR(3) );
+        render_mvaddstr( i, slen - buf_c, " " );
+        render_attroff( RENDER_COLOR(3) );
       }
     }
-    clrtoeol();
+    render_clrtoeol();
   }
-  for ( ; i < nrows; ++i )
+  for ( ; i < to; ++i )
   {
-    move( i, 0 );
-    clrtoeol();
+    render_move( i, 0 );
+    render_clrtoeol();
   }
-  move( cur_r, cur_c );
+  render_move( cur_r, cur_c );
 }
 
-void refresh_all(void)
+void refresh_buffer( int64_t starting_from_line )
 {
-  refresh_buffer( 0 );
-  refresh_status_bar( 0 );
-  move( cur_r, cur_c );
-  refresh();
+  refresh_rows( starting_from_line, nrows );
 }
 
-void init_colors(void)
+// the view moved down by k lines (up if k < 0): shift the rows that are
+// still visible with the terminal's scroll region and damage only the new ones
+static void scroll_rows( int64_t k )
 {
-  has_color = has_colors();
-  if ( ! has_color )
-    return;
-  start_color();
-  init_pair(1, COLOR_RED, COLOR_BLACK);
-  init_pair(2, COLOR_YELLOW, COLOR_BLACK);
-  // 8 is grey
-  init_pair(3, COLOR_WHITE, 8);
+  render_scroll( 0, nrows - 1, k ); //< not the status bar
+  if ( k > 0 )
+    damage_lines( buf_r + nrows - k, buf_r + nrows );
+  else
+    damage_lines( buf_r, buf_r - k );
 }
 
-
-void key_is_undefined_action( int32_t first, int32_t second )
+// repaint what was damaged
+void redraw(void)
 {
-  char to_print[64];
-  to_print[0] = 0;
-  char* tmp1 = deemacs_key_to_str_representation( first );
-  strcat( to_print, tmp1 );
-  free(tmp1);
+  if ( damage.hidden )
+    return;
 
-  if ( second != KBD_NOKEY )
+  // an overlay stays until the next command is done
+  if ( damage.overlay )
   {
-    char* tmp = deemacs_key_to_str_representation( second );
-    strcat( to_print, " ");
-    strcat( to_print, tmp);
-    free( tmp );
+    damage.overlay = false;
+    damage.full = true;
+    return;
   }
 
-  strcat( to_print, " is undefined" );
+  int rows, cols;
+  render_size( &rows, &cols );
+  if ( rows - 1 != nrows || cols != ncols )
+  {
+    nrows = rows - 1;
+    ncols = cols;
+    damage.full = true;
+  }
+  if ( ! damage.full && buf_c == damage.buf_c && buf_r != damage.buf_r
+       && buf_r - damage.buf_r < nrows && damage.buf_r - buf_r < nrows )
+    scroll_rows( buf_r - damage.buf_r );
+  else if ( buf_r != damage.buf_r || buf_c != damage.buf_c )
+    damage.full = true;
+
+  bool rows_damaged = damage.from < damage.to && damage.to > buf_r && damage.from < buf_r + nrows;
+  if ( damage.full )
+    refresh_rows( 0, nrows );
+  else if ( rows_damaged )
+  {
+    int64_t from = damage.from > buf_r ? damage.from - buf_r : 0;
+    int64_t to = damage.to - buf_r < nrows ? damage.to - buf_r : nrows;
+    refresh_rows( from, to );
+  }
+  if ( damage.full || damage.status || rows_damaged )
+    refresh_status_bar( 0 );
+
+  damage.from = damage.to = 0;
+  damage.status = damage.full = false;
+  damage.buf_r = buf_r;
+  damage.buf_c = buf_c;
+  render_move( cur_r, cur_c );
+  render_refresh();
+}
 
-  refresh_status_bar( to_print );
-  
-  beep();
+// keep the status bar and a screen that is not filled yet up to date while the file loads
+void on_idle_while_loading(void)
+{
+  int64_t old_sz = buf_sz();
+  tb_poll( &buf );
+  if ( buf.complete )
+    deemacs_set_idle_hook( 0, 0 );
+  if ( old_sz != buf_sz() && old_sz < buf_r + nrows )
+    refresh_buffer( 0 );
+  refresh_status_bar( status_extra_info );
+  render_refresh();
 }
 
-void f_add_char( int32_t c, int32_t no_key )
+void refresh_all(void)
 {
-  assert( no_key == KBD_NOKEY );
-  add_char_to_buf( c, cur_buf_r(), cur_buf_c() );
-  ++cur_c;
-  refresh_all();
+  damage.overlay = false;
+  damage.full = true;
+  redraw();
 }
 
+void init_colors(void)
+{
+  render_init_pair( 1, RENDER_RED, RENDER_BLACK );
+  render_init_pair( 2, RENDER_YELLOW, RENDER_BLACK );
+  render_init_pair( 3, RENDER_WHITE, RENDER_GREY );
+}
 
-void f_add_return(void)
+
+static void keys_are_undefined_action( const int32_t* keys, int n )
 {
-  add_newline_to_buf( cur_buf_r(), cur_buf_c() );
-  ++cur_r;
-  cur_c = 0;
-  refresh_all();
+  char to_print[KEYMAP_DEPTH_MAX * KBD_STR_MAX + 16];
+  keys_to_str( keys, n, to_print );
+  strcat( to_print, " is undefined" );
+
+  refresh_status_bar( to_print );
+  
+  ding();
 }
 
-bool handle_input(void)
+void key_is_undefined_action( int32_t first, int32_t second )
 {
-  int32_t first_key = deemacs_next_key();
+  int32_t keys[2] = { first, second };
+  keys_are_undefined_action( keys, second != KBD_NOKEY ? 2 : 1 );
+}
 
-  if ( first_key <= 255 && ( isgraph( first_key ) || first_key == ' ' ) )
+// insert n times the character c
+void f_add_char( int32_t c, int64_t n )
+{
+  if ( n <= 0 )
+    return;
+  if ( n == 1 )
   {
-    f_add_char( first_key, KBD_NOKEY );
-    return true;
+    add_char_to_buf( c, cur_buf_r(), cur_buf_c() );
+    try_move_cursor_to_buf_pos( cur_buf_r(), cur_buf_c()+1, 0 );
+    return;
   }
+  char* s = malloc( n );
+  if ( ! s ) err( EX_OSERR, NULL );
+  memset( s, c, n );
+  int64_t r, col;
+  insert_text_to_buf( cur_buf_r(), cur_buf_c(), s, n, &r, &col );
+  free( s );
+  try_move_cursor_to_buf_pos( r, col, 0 );
+}
 
-  bool prefix_exists = 0;
 
-  for ( int i = 0; i < sizeof(bindings) / sizeof(bindings[0]); ++i )
-  {
-    struct Binding* tmp = &bindings[i];
-    if ( tmp->first == first_key )
-    {
-      prefix_exists = 1;
-      if ( tmp->second == KBD_NOKEY )
-      {
-        // match
-        tmp->func();
-        return true;
-      }
-    }
-  }
+static void f_paste( int64_t n )
+{
+  int64_t len;
+  const char* text = deemacs_paste_text( &len );
+  int64_t r, c;
+  insert_text_to_buf( cur_buf_r(), cur_buf_c(), text, len, &r, &c );
+  try_move_cursor_to_buf_pos( r, c, 0 );
+}
 
-  if ( ! prefix_exists )
+// insert n line breaks
+void f_add_return( int64_t n )
+{
+  if ( n <= 0 )
+    return;
+  if ( n == 1 )
   {
-    key_is_undefined_action( first_key, KBD_NOKEY );
-    return true;
+    add_newline_to_buf( cur_buf_r(), cur_buf_c() );
+    try_move_cursor_to_buf_pos( cur_buf_r()+1, 0, 0 );
+    return;
   }
+  char* s = malloc( n );
+  if ( ! s ) err( EX_OSERR, NULL );
+  memset( s, '\n', n );
+  int64_t r, c;
+  insert_text_to_buf( cur_buf_r(), cur_buf_c(), s, n, &r, &c );
+  free( s );
+  try_move_cursor_to_buf_pos( r, c, 0 );
+}
 
-  int32_t second_key = deemacs_next_key();
-//  printw( " %d", second_key );
-
-  // special case: CTRL-G: break everything
-  if ( second_key == (KBD_CTRL | 'g') )
+// run the command bound to the keys starting with key, with count n
+static void run_command( int32_t key, int64_t n )
+{
+  if ( key == KBD_NOKEY )
+    return; //< no key, like after a resize of the terminal, the screen is redrawn
+  if ( key <= 255 && ( isgraph( key ) || key == ' ' ) )
   {
-    f_keyboard_quit();
-    return true;
+    f_add_char( key, n );
+    return;
   }
 
-  char* keystr2 = deemacs_key_to_str_representation( second_key );
-//  addstr( keystr2 );
-  free( keystr2 );
-
-  for ( int i = 0; i < sizeof(bindings) / sizeof(bindings[0]); ++i )
+  // follow the prefix keymaps down to a command
+  int32_t keys[KEYMAP_DEPTH_MAX];
+  const struct keymap* km = keymap;
+  for ( int depth = 1; ; ++depth )
   {
-    struct Binding* tmp = &bindings[i];
-    if ( tmp->first == first_key && tmp->second == second_key )
+    keys[depth-1] = key;
+    const struct keymap_entry* e = keymap_lookup( km, key );
+    if ( e->func )
     {
-      tmp->func();
-      return true;
+      e->func( n );
+      return;
     }
-  }
+    if ( ! e->prefix )
+    {
+      keys_are_undefined_action( keys, depth );
+      return;
+    }
+    km = e->prefix;
+    key = deemacs_next_key();
+    if ( key == KBD_NOKEY )
+      return; //< like at the top, the prefix is dropped and the screen redrawn
 
-  key_is_undefined_action( first_key, second_key );
-  return true;
+    // special case: CTRL-G: break everything
+    if ( key == (KBD_CTRL | 'g') )
+    {
+      f_keyboard_quit( 1 );
+      return;
+    }
+  }
 }
 
-static bool find_next_in_buffer( int64_t r, int64_t c, int64_t* r2, int64_t* c2, const char* needle )
+bool handle_input(void)
 {
-  // contains upper
-  bool has_upper = false;
-  for ( int i = 0; i < strlen(needle); ++i )
-    if ( isupper( needle[i] ) )
-      has_upper = true;
+  deemacs_kmacro_command_start();
+  run_command( deemacs_next_key(), 1 );
+  return true;
+}
 
-  char* match = has_upper ? strcasestr( buf[r]+c, needle ) : strstr( buf[r]+c, needle );
-  if ( match != 0 )
-  {
-    *r2=r;
-    *c2=match-buf[r];
-    return true;
-  }
+// C-u reads the count of the next command: C-u alone is 4 and each further
+// C-u multiplies it by 4, digits after C-u (and a leading -) are the count.
+// C-u after the digits ends them, so the command can be a digit.
+#define PREFIX_MAX INT32_MAX //< larger counts are cut
 
-  for ( int64_t cr=r+1;cr<buf_sz;++cr )
+static void f_universal_argument( int64_t n )
+{
+  int64_t count = 4;
+  int64_t digits = -1; //< none typed yet
+  bool negative = false;
+  int32_t key;
+  while ( 1 )
   {
-    char* match = has_upper ? strcasestr( buf[cr], needle ) : strstr( buf[cr], needle );
-    if ( match != 0 )
+    char msg[64];
+    if ( digits >= 0 || negative )
+      snprintf( msg, sizeof(msg), "C-u %s%" PRId64, negative ? "-" : "", digits >= 0 ? digits : 1 );
+    else
+      snprintf( msg, sizeof(msg), "C-u %" PRId64, count );
+    refresh_status_bar( msg );
+    if ( ! damage.hidden )
+      render_refresh();
+
+    key = deemacs_next_key();
+    if ( key == ('u' | KBD_CTRL) && digits < 0 && ! negative )
+      count = count < PREFIX_MAX / 4 ? count * 4 : PREFIX_MAX;
+    else if ( key == ('u' | KBD_CTRL) )
     {
-      *r2=cr;
-      *c2=match-buf[cr];
-      return true;
+      key = deemacs_next_key();
+      break;
     }
+    else if ( key >= '0' && key <= '9' )
+      digits = digits < 0 ? key - '0' : digits < PREFIX_MAX / 10 ? digits * 10 + key - '0' : PREFIX_MAX;
+    else if ( key == '-' && digits < 0 && ! negative )
+      negative = true;
+    else
+      break;
   }
+  refresh_status_bar( 0 );
+  if ( key == (KBD_CTRL | 'g') )
+  {
+    f_keyboard_quit( 1 );
+    return;
+  }
+  n = digits >= 0 ? digits : negative ? 1 : count;
+  run_command( key, negative ? -n : n );
+}
 
-  return false;
+// first match at or after column c of line r, or the last one starting
+// before it when searching backward
+// Large buffers are searched on all cores in the background, *cancelled is
+// set if the user pressed C-g meanwhile.
+static bool find_in_buffer( bool backward, int64_t r, int64_t c, struct search_hit* hit, const struct search* needle, bool* cancelled )
+{
+  tb_poll( &buf );
+  struct search_job* job = search_job_start( needle, &buf, backward, r, c );
+  *cancelled = false;
+  while ( ! search_job_done( job ) && ! *cancelled )
+    *cancelled = deemacs_poll_cancel( 20 );
+  return search_job_finish( job, *cancelled, hit );
 }
 
 // return value must be freed, can be nullptr on error
@@ -908,6 +1380,7 @@ char* get_input_line( const char* prefix )
 {
   char* input = malloc(32);
   int input_cap = 32;
+  input[0] = 0;
 
   refresh_status_bar( prefix );
 
@@ -926,7 +1399,7 @@ char* get_input_line( const char* prefix )
       if ( strlen( input ) > 0 )
         input[ strlen(input) - 1 ] = 0;
       else
-        beep();
+        ding();
     }
     // finish search
     else if ( key == KBD_RET )
@@ -954,21 +1427,207 @@ char* get_input_line( const char* prefix )
     strcpy( statusmsg, prefix );
     strcat( statusmsg, input );
     refresh_status_bar( statusmsg );
+    free( statusmsg );
   }
   
 }
 
-static void f_go_to_line(void)
+static void f_go_to_line( int64_t n )
 {
   char* arg = get_input_line( "Goto line: " );
   if (arg==0)
     return;
   int64_t line = atoll( arg );
+  buf_wait_line( line-1 );
   try_move_cursor_to_buf_pos( line-1, 0, 1 );
 }
 
+static void f_set_mark( int64_t n )
+{
+  mark_r = cur_buf_r();
+  mark_c = cur_buf_c();
+  refresh_status_bar( "Mark set" );
+}
+
+// Keyboard macros are played with the screen frozen: commands only mark
+// what they change and the screen is repainted once when all repetitions
+// are done.  Playing stops at the first command that fails.
+#define KMACRO_POLL 1024 //< repetitions between checks for C-g
+
+static bool kmacro_failed; //< a command of the macro played failed, see ding()
+
+// signal a failed command, stops a keyboard macro instead of beeping then
+void ding(void)
+{
+  if ( deemacs_kmacro_playing() )
+  {
+    kmacro_failed = true;
+    return;
+  }
+  render_beep();
+}
+
+// play the last macro once, false if one of its commands failed
+static bool kmacro_play_once(void)
+{
+  deemacs_kmacro_play();
+  kmacro_failed = false;
+  while ( ! deemacs_kmacro_done() && ! kmacro_failed )
+    handle_input();
+  deemacs_kmacro_stop();
+  return ! kmacro_failed;
+}
+
+// the macro can be played, shows why not otherwise
+static bool kmacro_check(void)
+{
+  if ( deemacs_kmacro_playing() )
+  {
+    ding(); //< a macro calling itself
+    return false;
+  }
+  if ( ! deemacs_kmacro_defined() )
+  {
+    refresh_status_bar( "No keyboard macro defined" );
+    ding();
+    return false;
+  }
+  return true;
+}
+
+// play the last macro n times, until a command fails if n is 0
+static void kmacro_call( int64_t n )
+{
+  if ( ! kmacro_check() )
+    return;
+  damage.hidden = true;
+  for ( int64_t i = 1; kmacro_play_once() && i != n; ++i )
+  {
+    if ( i % KMACRO_POLL == 0 && deemacs_poll_cancel( 0 ) )
+      break;
+  }
+  damage.hidden = false;
+  refresh_all();
+}
+
+static void f_kmacro_start( int64_t n )
+{
+  if ( deemacs_kmacro_recording() )
+  {
+    refresh_status_bar( "Already defining keyboard macro" );
+    ding();
+    return;
+  }
+  deemacs_kmacro_start();
+  refresh_status_bar( "Defining keyboard macro..." );
+}
+
+static void f_kmacro_end( int64_t n )
+{
+  if ( ! deemacs_kmacro_recording() )
+  {
+    refresh_status_bar( "Not defining keyboard macro" );
+    ding();
+    return;
+  }
+  refresh_status_bar( deemacs_kmacro_end() ? "Keyboard macro defined" : "Ignore empty macro" );
+}
+
+static void f_kmacro_end_and_call( int64_t n )
+{
+  if ( deemacs_kmacro_recording() )
+    f_kmacro_end( 1 );
+  if ( n < 0 )
+    ding();
+  else
+    kmacro_call( n );
+}
 
-static void isearch( bool backward /* todo(dees): backword is not working, fix */ )
+// play the last macro at the beginning of each line between point and mark
+// A line the region ends at the beginning of is not part of it.  Lines the
+// macro inserts or removes are followed, so each original line is visited
+// once.
+static void f_kmacro_region_lines( int64_t n )
+{
+  if ( mark_r < 0 )
+  {
+    refresh_status_bar( "The mark is not set now" );
+    ding();
+    return;
+  }
+  if ( ! kmacro_check() )
+    return;
+  int64_t top = mark_r < cur_buf_r() ? mark_r : cur_buf_r();
+  int64_t end = mark_r < cur_buf_r() ? cur_buf_r() : mark_r;
+  int64_t end_c = mark_r < cur_buf_r() || ( mark_r == cur_buf_r() && mark_c < cur_buf_c() ) ? cur_buf_c() : mark_c;
+  if ( end_c > 0 || end == top )
+    ++end;
+
+  int64_t next = top;
+  add_marker( &next );
+  add_marker( &end );
+  damage.hidden = true;
+  for ( int64_t i = 1; next < end && buf_has_line( next ); ++i )
+  {
+    try_move_cursor_to_buf_pos( next, 0, 0 );
+    ++next;
+    if ( ! kmacro_play_once() || ( i % KMACRO_POLL == 0 && deemacs_poll_cancel( 0 ) ) )
+      break;
+  }
+  damage.hidden = false;
+  remove_marker( &next );
+  remove_marker( &end );
+  refresh_all();
+}
+
+
+// One entry per isearch step (typed character or repeated search), so
+// backspace can go back to the previous step without searching again.
+struct isearch_state
+{
+  int nlen;       //< length of the needle at this step
+  int64_t r, c;   //< start of the match, or of the last match if failing
+  int64_t len;    //< length of the match
+  int64_t br, bc; //< where the last C-s or C-r started, regexps are searched again from there
+  bool found;
+  bool wrapped;
+  bool backward;
+};
+
+// the cursor is put behind a forward match and onto a backward one
+static void isearch_move_cursor( const struct isearch_state* st )
+{
+  try_move_cursor_to_buf_pos( st->r, st->backward ? st->c : st->c + st->len, 1 );
+}
+
+// show the len bytes at column c of line r highlighted
+// This is the matched text, which differs from the needle for regexps.
+static void highlight_match( int64_t r, int64_t c, int64_t len )
+{
+  if ( damage.hidden )
+    return;
+  int64_t y = r - buf_r;
+  int64_t x = c - buf_c;
+  if ( y < 0 || y >= nrows || x < 0 || x >= ncols )
+    return;
+  const struct line* line = tb_line( &buf, r );
+  render_attron( RENDER_COLOR(2) | RENDER_STANDOUT );
+  render_mvaddnstr( y, x, line_data( line ) + c, len < ncols - x ? len : ncols - x );
+  damage_lines( r, r + 1 );
+  render_attroff( RENDER_COLOR(2) | RENDER_STANDOUT );
+}
+
+// compile the needle again, returns the error of an invalid regexp
+static const char* isearch_compile( struct search* compiled, const char* needle, int nlen, bool regexp )
+{
+  search_free( compiled );
+  if ( regexp )
+    return search_init_regex( compiled, needle, nlen );
+  search_init( compiled, needle, nlen );
+  return 0;
+}
+
+static void isearch( bool backward, bool regexp )
 {
   int64_t c = cur_buf_c();
   int64_t r = cur_buf_r();
@@ -976,59 +1635,112 @@ static void isearch( bool backward /* todo(dees): backword is not working, fix *
   char* needle = malloc(32);
   int needle_cap = 32;
   needle[0] = 0;
-
-  int match_next = 0;
-
-  const char status_msg_failing[] = "Failing search: ";
-  const char status_msg_wrapped[] = "Wrapped search: ";
+  struct search compiled;
+  search_init( &compiled, needle, 0 );
+  const char* error = 0;
+
+  struct isearch_state* states = malloc( 32 * sizeof(struct isearch_state) );
+  int states_cap = 32;
+  int nstates = 1;
+  states[0] = (struct isearch_state) { 0, r, c, 0, r, c, true, false, backward };
+
+  const char status_msg_failing[] = "Failing ";
+  const char status_msg_wrapped[] = "Wrapped ";
+  const char status_msg_regexp[] = "regexp ";
   const char status_msg_prefix[] = "search: ";
-  // keep up-to date with the 3 msgs
-  int status_prefix_max_len = strlen( status_msg_wrapped );
+  const char status_msg_backward[] = "backward search: ";
+  // keep up-to date with the msgs
+  int status_prefix_max_len = strlen( status_msg_wrapped ) + strlen( status_msg_regexp ) + strlen( status_msg_backward );
 
-  refresh_status_bar( status_msg_prefix );
+  char* status_msg = malloc( status_prefix_max_len + 1 );
+  strcpy( status_msg, regexp ? status_msg_regexp : "" );
+  strcat( status_msg, backward ? status_msg_backward : status_msg_prefix );
+  refresh_status_bar( status_msg );
+  free( status_msg );
 
   while ( 1 )
   {
     int32_t first_key = deemacs_next_key();
+    struct isearch_state top = states[nstates-1];
+    struct isearch_state next = top;
+
+    bool cancelled = false;
+    struct search_hit hit;
 
     // out
     if ( first_key == (KBD_CTRL | 'g') )
     {
       if ( cur_buf_c() != c || cur_buf_r() != r )
         try_move_cursor_to_buf_pos( r, c, 1 );
-      free(needle);
-      return;
+      break;
     }
-    // delete one char
+    // back to the previous step
     else if ( first_key == KBD_BS )
     {
-      if ( match_next > 0 )
-        --match_next;
-      else if ( strlen( needle ) > 0 )
-        needle[ strlen(needle) - 1 ] = 0;
-      else
-        beep();
+      if ( nstates == 1 )
+      {
+        ding();
+        continue;
+      }
+      --nstates;
+      top = states[nstates-1];
+      needle[ top.nlen ] = 0;
+      if ( top.nlen != next.nlen )
+        error = isearch_compile( &compiled, needle, top.nlen, regexp );
+      if ( top.found )
+        isearch_move_cursor( &top );
+      else if ( nstates == 1 )
+        try_move_cursor_to_buf_pos( r, c, 1 );
     }
-    // next match
-    else if ( first_key == ('s' | KBD_CTRL) )
-      ++match_next;
-    // finish search
-    else if ( first_key == KBD_RET )
+    // next match in either direction, resumes at the current one or wraps
+    // around if failing in the same direction
+    else if ( (first_key & ~KBD_META) == ('s' | KBD_CTRL) || (first_key & ~KBD_META) == ('r' | KBD_CTRL) )
     {
-      free(needle);
-      return;
+      next.backward = (first_key & ~KBD_META) == ('r' | KBD_CTRL);
+      // a regexp resumes behind the match, or [0-9]+ would find the rest
+      // of the same number
+      int64_t rs = top.r;
+      int64_t cs = next.backward ? top.c : top.c + (regexp && top.len > 0 ? top.len : 1);
+      if ( ! top.found && next.backward == top.backward )
+      {
+        rs = next.backward ? buf_sz() - 1 : 0;
+        cs = next.backward ? INT64_MAX : 0;
+        next.wrapped = true;
+      }
+      next.br = rs;
+      next.bc = cs;
+      next.found = ! error && find_in_buffer( next.backward, rs, cs, &hit, &compiled, &cancelled );
+      if ( ! next.found && ! cancelled )
+        ding();
     }
+    // finish search
+    else if ( first_key == KBD_RET )
+      break;
     // add character to search pattern
     else if ( first_key <= 255 && ( isgraph( first_key ) || first_key == ' ' ) )
     {
-      int nlen = strlen(needle);
-      if ( nlen+1 >= needle_cap )
+      if ( top.nlen+1 >= needle_cap )
       {
         needle = REALLOCF( needle, needle_cap*2 );
         needle_cap *= 2;
       }
-      needle[ nlen ] = first_key;
-      needle[ nlen + 1 ] = 0;
+      needle[ top.nlen ] = first_key;
+      needle[ top.nlen + 1 ] = 0;
+      ++next.nlen;
+      error = isearch_compile( &compiled, needle, next.nlen, regexp );
+      // a longer needle can only match at the current match or further in
+      // the search direction, a backward search starts before the cursor
+      // A longer regexp may match anywhere, it is searched again from where
+      // the last C-s or C-r started.
+      if ( error )
+        next.found = false;
+      else if ( regexp )
+        next.found = find_in_buffer( top.backward, top.br, top.bc, &hit, &compiled, &cancelled );
+      else if ( top.found )
+      {
+        int64_t cs = top.backward && nstates > 1 ? top.c + 1 : top.c;
+        next.found = find_in_buffer( top.backward, top.r, cs, &hit, &compiled, &cancelled );
+      }
     }
     else
     {
@@ -1036,83 +1748,398 @@ static void isearch( bool backward /* todo(dees): backword is not working, fix *
       continue;
     }
 
-    int64_t cspos = c;
-    int64_t crpos = r;
-    bool has_wrapped = 0;
-    bool has_matched = 0;
-    for ( int nmatch = 0; nmatch <= match_next; ++nmatch )
+    // C-g during a long search quits like C-g after it
+    if ( cancelled )
     {
-      int64_t rmatch;
-      int64_t cmatch;
-      bool is_found = find_next_in_buffer( crpos, cspos, &rmatch, &cmatch, needle );
-      if ( ! is_found && has_wrapped && crpos == 0 && cspos == 0 )
-      {
-        beep();
-      }
-      else if ( ! is_found )
-      {
-        has_wrapped = 1;
-        cspos = 0;
-        crpos = 0;
-      }
-      else if ( is_found && nmatch == match_next ) //< bingo
+      try_move_cursor_to_buf_pos( r, c, 1 );
+      refresh_status_bar( "Quit" );
+      break;
+    }
+
+    if ( first_key != KBD_BS )
+    {
+      if ( nstates == states_cap )
       {
-        try_move_cursor_to_buf_pos( rmatch, cmatch + strlen(needle), 1 );
-        cspos = cmatch;
-        crpos = rmatch;
-        has_matched = 1;
+        states_cap *= 2;
+        states = REALLOCF( states, states_cap * sizeof(struct isearch_state) );
       }
-      else
+      // if failing the last match is kept for the next C-s or backspace
+      if ( next.found )
       {
-        assert( is_found );
-        assert( nmatch != match_next );
-        cspos = cmatch+1;
-        crpos = rmatch;
+        next.r = hit.r;
+        next.c = hit.c;
+        next.len = hit.len;
+        isearch_move_cursor( &next );
       }
+      states[nstates++] = next;
     }
+    top = states[nstates-1];
 
-    char* status_msg = malloc(strlen(needle)+status_prefix_max_len+1);
+    // the error of an invalid regexp follows the needle in brackets
+    int error_len = error ? strlen( error ) + 3 : 0;
+    status_msg = malloc( strlen(needle)+status_prefix_max_len+error_len+1 );
     status_msg[0] = 0;
-    if ( ! has_matched )
+    if ( ! top.found )
       strcat( status_msg, status_msg_failing );
-    else if ( has_wrapped )
+    else if ( top.wrapped )
       strcat( status_msg, status_msg_wrapped );
-    else
-      strcat( status_msg, status_msg_prefix );
+    if ( regexp )
+      strcat( status_msg, status_msg_regexp );
+    strcat( status_msg, top.backward ? status_msg_backward : status_msg_prefix );
     strcat( status_msg, needle );
+    if ( error )
+    {
+      strcat( status_msg, " [" );
+      strcat( status_msg, error );
+      strcat( status_msg, "]" );
+    }
     refresh_status_bar( status_msg );
     free(status_msg);
 
     // highlite match
-    if (has_matched)
+    if ( top.found )
+      highlight_match( top.r, top.c, top.len );
+  }
+
+  search_free( &compiled );
+  free(states);
+  free(needle);
+}
+
+static void f_isearch_forward( int64_t n )
+{
+  isearch( false, false );
+}
+
+static void f_isearch_backward( int64_t n )
+{
+  isearch( true, false );
+}
+
+static void f_isearch_forward_regexp( int64_t n )
+{
+  isearch( false, true );
+}
+
+static void f_isearch_backward_regexp( int64_t n )
+{
+  isearch( true, true );
+}
+
+// read the string to replace and its replacement, false if aborted
+static bool read_replace_args( const char* prompt, char** from, char** to )
+{
+  char* prefix = malloc( strlen( prompt ) + 3 );
+  sprintf( prefix, "%s: ", prompt );
+  *from = get_input_line( prefix );
+  free( prefix );
+  if ( ! *from )
+    return false;
+  if ( ! **from )
+  {
+    free( *from );
+    ding();
+    return false;
+  }
+  prefix = malloc( strlen( prompt ) + strlen( *from ) + 9 );
+  sprintf( prefix, "%s %s with: ", prompt, *from );
+  *to = get_input_line( prefix );
+  free( prefix );
+  if ( ! *to )
+  {
+    free( *from );
+    return false;
+  }
+  return true;
+}
+
+static void show_replaced( int64_t count )
+{
+  char msg[64];
+  snprintf( msg, sizeof(msg), "Replaced %" PRId64 " occurrence%s", count, count == 1 ? "" : "s" );
+  refresh_status_bar( msg );
+}
+
+// replace from the cursor to the end of the buffer
+// The lines are rewritten in one pass and the screen is redrawn once.
+static void f_replace_string( int64_t n )
+{
+  char* from;
+  char* to;
+  if ( ! read_replace_args( "Replace string", &from, &to ) )
+    return;
+  tb_index_all( &buf );
+  struct search s;
+  search_init( &s, from, strlen( from ) );
+  struct search_hit last;
+  int64_t count = search_replace_all( &s, &buf, cur_buf_r(), cur_buf_c(), to, strlen( to ), &last );
+  search_free( &s );
+  if ( count > 0 )
+    try_move_cursor_to_buf_pos( last.r, last.c + last.len, 0 );
+  refresh_all();
+  show_replaced( count );
+  free( from );
+  free( to );
+}
+
+static void f_query_replace( int64_t n )
+{
+  char* from;
+  char* to;
+  if ( ! read_replace_args( "Query replace", &from, &to ) )
+    return;
+  int64_t to_len = strlen( to );
+  tb_index_all( &buf );
+  struct search s;
+  search_init( &s, from, strlen( from ) );
+
+  char* prompt = malloc( strlen( from ) + strlen( to ) + 64 );
+  sprintf( prompt, "Query replacing %s with %s: (y, n, !, q, .)", from, to );
+
+  int64_t r = cur_buf_r();
+  int64_t c = cur_buf_c();
+  int64_t count = 0;
+  struct search_hit hit;
+  bool cancelled = false;
+  while ( find_in_buffer( false, r, c, &hit, &s, &cancelled ) )
+  {
+    try_move_cursor_to_buf_pos( hit.r, hit.c + hit.len, 1 );
+    refresh_status_bar( prompt );
+    highlight_match( hit.r, hit.c, hit.len );
+    render_move( cur_r, cur_c );
+
+    int32_t key = deemacs_next_key();
+    // the search goes on behind the replacement, which is never matched again
+    if ( key == 'y' || key == ' ' || key == '.' )
+    {
+      search_replace( &buf, &hit, to, to_len );
+      ++count;
+      r = hit.r;
+      c = hit.c + to_len;
+      try_move_cursor_to_buf_pos( r, c, 0 );
+      if ( key == '.' )
+        break;
+      refresh_all();
+    }
+    else if ( key == 'n' || key == KBD_BS )
+    {
+      r = hit.r;
+      c = hit.c + hit.len;
+    }
+    // the rest at once like replace-string
+    else if ( key == '!' )
     {
-      add_special_buffer_message(crpos-buf_r,cspos-buf_c,needle);
+      struct search_hit last;
+      int64_t n = search_replace_all( &s, &buf, hit.r, hit.c, to, to_len, &last );
+      count += n;
+      if ( n > 0 )
+        try_move_cursor_to_buf_pos( last.r, last.c + last.len, 0 );
+      break;
     }
+    else if ( key == 'q' || key == KBD_RET || key == KBD_CANCEL )
+      break;
+    else
+      ding();
+  }
+
+  refresh_all();
+  if ( cancelled )
+    refresh_status_bar( "Quit" );
+  else
+    show_replaced( count );
+  search_free( &s );
+  free( prompt );
+  free( from );
+  free( to );
+}
+
+
+// Occur view: the lines matching a regexp, listed on top of the buffer.  The
+// lines are searched on all cores in the background and the list grows while
+// the idle hook pulls them in, so the first hits show up right away.
+struct occur_state
+{
+  struct search_lines* job;
+  int64_t* rows;  //< matching lines found so far
+  int64_t n, cap;
+  int64_t top;    //< first entry on the screen
+  int64_t sel;    //< selected entry
+  bool scanning;
+};
+
+static struct occur_state occur;
+
+#define OCCUR_PULL 4096 //< rows taken from the job at once
+#define OCCUR_NUM_WIDTH 8 //< the line numbers in front of the lines
 
+// take the rows found so far, true if there were new ones
+static bool occur_pull(void)
+{
+  bool any = false;
+  while ( 1 )
+  {
+    if ( occur.cap - occur.n < OCCUR_PULL )
+    {
+      occur.cap = occur.cap * 2 + OCCUR_PULL;
+      occur.rows = REALLOCF( occur.rows, occur.cap * sizeof(int64_t) );
+      if ( ! occur.rows ) err( EX_OSERR, NULL );
+    }
+    int64_t k = search_lines_next( occur.job, occur.rows + occur.n, OCCUR_PULL );
+    if ( k == 0 )
+      break;
+    occur.n += k;
+    any = true;
   }
+  occur.scanning = ! search_lines_done( occur.job );
+  return any;
+}
 
+static void occur_draw(void)
+{
+  if ( damage.hidden )
+    return;
+  for ( int64_t i = 0; i < nrows; ++i )
+  {
+    render_move( i, 0 );
+    render_clrtoeol();
+    if ( occur.top + i >= occur.n )
+      continue;
+    int64_t row = occur.rows[occur.top + i];
+    char num[32];
+    snprintf( num, sizeof(num), "%*" PRId64 ":", OCCUR_NUM_WIDTH - 1, row + 1 );
+    add_special_buffer_message( i, 0, num );
+    const struct line* line = tb_line( &buf, row );
+    int64_t len = line_len( line );
+    if ( len > ncols - OCCUR_NUM_WIDTH )
+      len = ncols - OCCUR_NUM_WIDTH;
+    if ( occur.top + i == occur.sel ) render_attron( RENDER_REVERSE );
+    if ( len > 0 )
+      render_mvaddnstr( i, OCCUR_NUM_WIDTH, line_data( line ), len );
+    if ( occur.top + i == occur.sel ) render_attroff( RENDER_REVERSE );
+  }
+  char msg[64];
+  snprintf( msg, sizeof(msg), "%" PRId64 " matching line%s%s", occur.n, occur.n == 1 ? "" : "s", occur.scanning ? " (scanning...)" : "" );
+  refresh_status_bar( msg );
+  render_move( occur.sel - occur.top, 0 );
+  render_refresh();
 }
 
-static void f_isearch_forward(void)
+static void occur_idle(void)
 {
-  isearch( false );
+  bool was_scanning = occur.scanning;
+  bool grown = occur_pull();
+  if ( ! occur.scanning )
+    deemacs_set_idle_hook( 0, 0 );
+  // only new lines that land on the screen need a full redraw
+  if ( grown || was_scanning != occur.scanning )
+    occur_draw();
 }
 
+static void f_occur( int64_t n )
+{
+  char* pattern = get_input_line( "List lines matching regexp: " );
+  if ( ! pattern )
+    return;
+  if ( ! *pattern )
+  {
+    free( pattern );
+    refresh_status_bar( 0 );
+    ding();
+    return;
+  }
+  struct search s;
+  const char* error = search_init_regex( &s, pattern, strlen( pattern ) );
+  free( pattern );
+  if ( error )
+  {
+    search_free( &s );
+    char msg[128];
+    snprintf( msg, sizeof(msg), "Invalid regexp: %s", error );
+    refresh_status_bar( msg );
+    ding();
+    return;
+  }
+  tb_index_all( &buf );
+
+  memset( &occur, 0, sizeof(occur) );
+  occur.job = search_lines_start( &s, &buf );
+  occur.scanning = true;
+  occur_pull();
+  occur_draw();
+  if ( occur.scanning )
+    deemacs_set_idle_hook( occur_idle, 50 );
+
+  int64_t jump = -1;
+  while ( 1 )
+  {
+    int32_t key = deemacs_next_key();
+    occur_pull();
+    int64_t page = nrows > 1 ? nrows - 1 : 1;
+    if ( key == ('n' | KBD_CTRL) || key == KBD_DOWN )
+      ++occur.sel;
+    else if ( key == ('p' | KBD_CTRL) || key == KBD_UP )
+      --occur.sel;
+    else if ( key == ('v' | KBD_CTRL) || key == KBD_PGDN )
+      occur.sel += page;
+    else if ( key == ('v' | KBD_META) || key == KBD_PGUP )
+      occur.sel -= page;
+    else if ( key == ('<' | KBD_META) )
+      occur.sel = 0;
+    else if ( key == ('>' | KBD_META) )
+      occur.sel = occur.n - 1;
+    else if ( key == KBD_RET && occur.n > 0 )
+    {
+      jump = occur.rows[occur.sel];
+      break;
+    }
+    else if ( key == 'q' || key == KBD_CANCEL )
+      break;
+    else
+      ding();
+
+    if ( occur.sel >= occur.n ) occur.sel = occur.n - 1;
+    if ( occur.sel < 0 ) occur.sel = 0;
+    if ( occur.sel < occur.top ) occur.top = occur.sel;
+    if ( occur.sel >= occur.top + nrows ) occur.top = occur.sel - nrows + 1;
+    occur_draw();
+  }
+
+  deemacs_set_idle_hook( 0, 0 );
+  search_lines_finish( occur.job );
+  free( occur.rows );
+  if ( jump >= 0 )
+  {
+    // onto the first match in the line
+    struct search_hit hit;
+    int64_t c = search_forward( &s, &buf, jump, 0, &hit ) && hit.r == jump ? hit.c : 0;
+    try_move_cursor_to_buf_pos( jump, c, 0 );
+  }
+  search_free( &s );
+  refresh_all();
+}
 
 void editor(void)
 {
-  WINDOW* wnd = initscr();
-  raw();
-  noecho();
-  nonl();
-  intrflush(stdscr, FALSE);
-  keypad(stdscr, TRUE);
+  render_init( output, verbose_flag );
 
   init_colors();
+  init_keymap();
+  if ( raw_input || output == RENDER_ANSI ) //< only curses reads keys for curses
+    deemacs_input_raw( esc_timeout );
 
-  getmaxyx(wnd,nrows,ncols);
+  render_size( &nrows, &ncols );
   --nrows;
+  set_bracketed_paste( true );
 
   refresh_all();
-  while ( handle_input() );
+  // keys typed ahead or pasted are all applied before the screen is
+  // repainted once, but a long stream of input still shows progress
+  int batched = 0;
+  while ( handle_input() )
+  {
+    if ( ++batched < TYPEAHEAD_MAX && deemacs_input_pending() )
+      continue;
+    redraw();
+    batched = 0;
+  }
 }
@@ -1,9 +1,17 @@
+#define _DEFAULT_SOURCE //< poll
 #include "input.h"
+#include "render.h"
 
 #include <curses.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdbool.h>
+#include <err.h>
+#include <errno.h>
+#include <sysexits.h>
+#include <poll.h>
+#include <unistd.h>
 
 static int32_t codetokey (int32_t c)
 {
@@ -103,10 +111,8 @@ static int32_t codetokey (int32_t c)
     }
 }
 
-char* deemacs_key_to_str_representation( int32_t key )
+void deemacs_key_to_str( int32_t key, char res[KBD_STR_MAX] )
 {
-  // C-M-<backspace> is longest string with 11+2+2+1=16 chars.
-  char* res = malloc( 16 );
   *res = 0;
 
   if (key & KBD_CTRL)
@@ -192,6 +198,9 @@ char* deemacs_key_to_str_representation( int32_t key )
     case KBD_F12:
       strcat(res, "<f12>");
       break;
+    case KBD_PASTE:
+      strcat(res, "<paste>");
+      break;
     case ' ':
       strcat(res, "SPC");
       break;
@@ -203,18 +212,516 @@ char* deemacs_key_to_str_representation( int32_t key )
         res[l+1] = 0;
       }
       else
-        sprintf( res, "<%x>", (unsigned) key );
+        sprintf( res + strlen( res ), "<%x>", (unsigned) key );
     }
+}
+
+// keys read by deemacs_poll_cancel() for later
+#define PENDING_MAX 256
+static int32_t pending[PENDING_MAX];
+static int npending;
 
-  return res;
+static void (*idle_hook)( void );
+static int idle_interval;
+
+void deemacs_set_idle_hook( void (*hook)( void ), int interval_ms )
+{
+  idle_hook = hook;
+  idle_interval = interval_ms;
 }
 
-int32_t deemacs_next_key( void )
+// Raw input: instead of curses getch() the bytes are read from the tty with
+// poll() and read(), and escape sequences are decoded by raw_key().  An ESC
+// is only waited for esc_timeout ms to tell a sequence from a meta prefix,
+// curses waits its ESCDELAY instead.
+#define RAW_BUF 4096
+#define RAW_RESIZE -2 //< poll() was interrupted, usually by SIGWINCH
+
+static bool raw_input;
+static int esc_timeout = KBD_ESC_TIMEOUT;
+static unsigned char raw_buf[RAW_BUF]; //< read but not decoded yet
+static int raw_pos, raw_len;
+
+void deemacs_input_raw( int esc_timeout_ms )
+{
+  raw_input = true;
+  esc_timeout = esc_timeout_ms;
+}
+
+// wait up to timeout_ms (-1 forever) for input, 1 if there is some,
+// 0 on timeout or RAW_RESIZE
+static int raw_wait( int timeout_ms )
+{
+  if ( raw_pos < raw_len )
+    return 1;
+  if ( timeout_ms != 0 )
+    render_refresh(); //< like getch(), this also applies a new terminal size
+  struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+  int r = poll( &p, 1, timeout_ms );
+  if ( r < 0 && errno == EINTR )
+  {
+    render_refresh();
+    return RAW_RESIZE;
+  }
+  if ( r < 0 ) err( EX_IOERR, "poll" );
+  return r > 0;
+}
+
+// next byte, ERR if none came within timeout_ms or RAW_RESIZE
+static int raw_byte( int timeout_ms )
+{
+  int r = raw_wait( timeout_ms );
+  if ( r != 1 )
+    return r == 0 ? ERR : r;
+  if ( raw_pos == raw_len )
+  {
+    ssize_t n = read( STDIN_FILENO, raw_buf, sizeof(raw_buf) );
+    if ( n < 0 && errno == EINTR )
+      return RAW_RESIZE;
+    if ( n < 0 ) err( EX_IOERR, "read" );
+    if ( n == 0 ) errx( EX_IOERR, "end of input" );
+    raw_len = n;
+    raw_pos = 0;
+  }
+  return raw_buf[raw_pos++];
+}
+
+static int next_char( void )
 {
-  int32_t key = codetokey( getch() );
+  while ( 1 )
+  {
+    int c;
+    if ( raw_input )
+      c = raw_byte( idle_hook ? idle_interval : -1 );
+    else
+    {
+      timeout( idle_hook ? idle_interval : -1 );
+      c = getch();
+    }
+    if ( c != ERR || ! idle_hook )
+      return c;
+    idle_hook();
+  }
+}
+
+// Bracketed paste: the terminal sends pasted text between ESC [ 200 ~ and
+// ESC [ 201 ~, so it is inserted as a whole instead of typed key by key.
+#define PASTE_START "200~"  //< after ESC [, which arrives as M-[
+#define PASTE_END "\033[201~"
+// wait for the rest of the start sequence, the terminal sends it at once
+#define PASTE_START_TIMEOUT 50
+
+static char* paste;
+static int64_t paste_len, paste_cap;
+
+const char* deemacs_paste_text( int64_t* len )
+{
+  *len = paste_len;
+  return paste;
+}
+
+static void paste_add( char c )
+{
+  if ( paste_len == paste_cap )
+  {
+    paste_cap = paste_cap ? paste_cap * 2 : 4096;
+    paste = realloc( paste, paste_cap );
+    if ( ! paste ) err( EX_OSERR, NULL );
+  }
+  paste[paste_len++] = c;
+}
+
+// read the text up to the end sequence
+static void read_paste( void )
+{
+  paste_len = 0;
+  int end_len = strlen( PASTE_END );
+  bool cr = false;
+  if ( ! raw_input )
+    timeout( -1 );
+  while ( paste_len < end_len || memcmp( paste + paste_len - end_len, PASTE_END, end_len ) != 0 )
+  {
+    int c = raw_input ? raw_byte( -1 ) : getch();
+    if ( c < 0 || c > 0xff )
+      continue; //< a key code curses made of an escape sequence in the text
+    // terminals send line endings as CR
+    if ( c == '\n' && cr )
+    {
+      cr = false;
+      continue;
+    }
+    cr = c == '\r';
+    paste_add( cr ? '\n' : c );
+  }
+  paste_len -= end_len;
+}
+
+// M-[ was read, true if it starts a paste, which is read then
+// Otherwise M-[ and the keys read after it are queued for read_key().
+static bool paste_start( void )
+{
+  timeout( PASTE_START_TIMEOUT );
+  const char* seq = PASTE_START;
+  int i = 0;
+  int c = 0;
+  for ( ; seq[i]; ++i )
+  {
+    c = getch();
+    if ( c != seq[i] )
+      break;
+  }
+  if ( ! seq[i] )
+  {
+    read_paste();
+    return true;
+  }
+  int32_t keys[sizeof(PASTE_START) + 1] = { '[' | KBD_META };
+  int n = 1;
+  for ( int k = 0; k < i; ++k )
+    keys[n++] = seq[k];
+  if ( c != ERR )
+    keys[n++] = codetokey( c );
+  for ( int k = 0; k < n && npending < PENDING_MAX; ++k )
+    pending[npending++] = keys[k];
+  return false;
+}
+
+//// raw input decoder
+
+// keys of CSI (ESC [) and SS3 (ESC O) sequences by their final byte
+static const int32_t final_keys[128] =
+{
+  ['A'] = KBD_UP, ['B'] = KBD_DOWN, ['C'] = KBD_RIGHT, ['D'] = KBD_LEFT,
+  ['H'] = KBD_HOME, ['F'] = KBD_END, ['Z'] = KBD_TAB, //< back tab
+  ['P'] = KBD_F1, ['Q'] = KBD_F2, ['R'] = KBD_F3, ['S'] = KBD_F4,
+  ['M'] = KBD_RET, //< keypad enter
+};
+
+// keys of CSI sequences ending in ~ by their first parameter
+static const int32_t tilde_keys[] =
+{
+  [1] = KBD_HOME, [2] = KBD_INS, [3] = KBD_DEL, [4] = KBD_END,
+  [5] = KBD_PGUP, [6] = KBD_PGDN, [7] = KBD_HOME, [8] = KBD_END,
+  [11] = KBD_F1, [12] = KBD_F2, [13] = KBD_F3, [14] = KBD_F4, [15] = KBD_F5,
+  [17] = KBD_F6, [18] = KBD_F7, [19] = KBD_F8, [20] = KBD_F9, [21] = KBD_F10,
+  [23] = KBD_F11, [24] = KBD_F12,
+};
+
+#define CSI_PARAMS 4
+#define CSI_PARAM_MAX 9999
+#define CSI_MAX 32 //< longest sequence kept for esc_incomplete()
+
+static int32_t raw_key( void );
+
+// the bytes after ESC did not come in time: ESC was a meta prefix of the
+// first one, the others are keys of their own
+static int32_t esc_incomplete( const unsigned char* seq, int n )
+{
+  for ( int i = 1; i < n && npending < PENDING_MAX; ++i )
+    pending[npending++] = codetokey( seq[i] );
+  return codetokey( seq[0] ) | KBD_META;
+}
+
+// modifiers in the second parameter of xterm: 1 + shift 1, alt 2, ctrl 4, meta 8
+static int32_t esc_mods( int p )
+{
+  if ( p < 2 )
+    return 0;
+  int32_t mods = 0;
+  if ( (p - 1) & (2 | 8) )
+    mods |= KBD_META;
+  if ( (p - 1) & 4 )
+    mods |= KBD_CTRL;
+  return mods;
+}
+
+// the key of the bytes after an ESC
+// The state machine reads an introducer ([ or O), parameters separated by
+// ; and the final byte, which is looked up in the tables above.  Anything
+// else is a meta key, a lone ESC makes the next key a meta key.
+static int32_t raw_escape( void )
+{
+  int c = raw_byte( esc_timeout );
+  if ( c < 0 )
+    return raw_key() | KBD_META;
+  if ( c == 033 )
+    return raw_escape() | KBD_META;
+  if ( c != '[' && c != 'O' )
+    return codetokey( c ) | KBD_META;
+
+  unsigned char seq[CSI_MAX];
+  int n = 0;
+  seq[n++] = c;
+  int params[CSI_PARAMS] = { 0 };
+  int np = 0; //< index of the current parameter
+  while ( 1 )
+  {
+    c = raw_byte( esc_timeout );
+    if ( c < 0 )
+      return esc_incomplete( seq, n );
+    if ( n < CSI_MAX )
+      seq[n++] = c;
+    if ( c >= '0' && c <= '9' )
+    {
+      if ( np < CSI_PARAMS && params[np] <= CSI_PARAM_MAX )
+        params[np] = params[np] * 10 + c - '0';
+    }
+    else if ( c == ';' )
+      ++np;
+    else if ( c >= 0x20 && c < 0x40 )
+      ; //< private markers and intermediate bytes
+    else if ( c >= 0x40 && c < 0x7f )
+      break;
+    else
+      return KBD_NOKEY;
+  }
+
+  int32_t key = 0;
+  if ( c == '~' && seq[0] == '[' && params[0] == 200 )
+  {
+    read_paste();
+    return KBD_PASTE;
+  }
+  if ( c == '~' )
+    key = params[0] < sizeof(tilde_keys) / sizeof(tilde_keys[0]) ? tilde_keys[params[0]] : 0;
+  else
+    key = final_keys[c];
+  if ( ! key )
+    return KBD_NOKEY;
+  return key | esc_mods( params[1] );
+}
+
+static int32_t raw_key( void )
+{
+  int c = next_char();
+  if ( c < 0 )
+    return KBD_NOKEY; //< the terminal was resized
+  if ( c == 033 )
+    return raw_escape();
+  return codetokey( c );
+}
+
+static int32_t read_key( void )
+{
+  if ( npending > 0 )
+  {
+    int32_t key = pending[0];
+    memmove( pending, pending + 1, --npending * sizeof(int32_t) );
+    return key;
+  }
+  if ( raw_input )
+    return raw_key();
+  int32_t key = codetokey( next_char() );
   while ( key == KBD_META )
   {
-    key = codetokey( getch() ) | KBD_META ;
+    key = codetokey( next_char() ) | KBD_META ;
+  }
+  if ( key == ('[' | KBD_META) )
+    return paste_start() ? KBD_PASTE : read_key();
+  return key;
+}
+
+// Keyboard macros are the keys returned by deemacs_next_key(), a KBD_PASTE
+// is followed by the length of its text, which is kept in text.  The length
+// takes two entries of 31 bits, the low ones first.
+struct kmacro
+{
+  int32_t* keys;
+  int64_t nkeys, cap;
+  char* text;
+  int64_t text_len, text_cap;
+};
+
+static struct kmacro kmacro;    //< the last macro defined
+static struct kmacro recording; //< the macro being defined
+static bool is_recording;
+static int64_t command_start;   //< keys of recording before the running command
+static int64_t play_pos = -1;   //< next key of kmacro played, -1 if not playing
+static int64_t play_text;       //< text of the next KBD_PASTE played
+
+static void kmacro_add_key( struct kmacro* m, int32_t key )
+{
+  if ( m->nkeys == m->cap )
+  {
+    m->cap = m->cap ? m->cap * 2 : 64;
+    m->keys = realloc( m->keys, m->cap * sizeof(int32_t) );
+    if ( ! m->keys ) err( EX_OSERR, NULL );
+  }
+  m->keys[m->nkeys++] = key;
+}
+
+static void kmacro_add_text( struct kmacro* m, const char* s, int64_t n )
+{
+  if ( m->text_len + n > m->text_cap )
+  {
+    while ( m->text_len + n > m->text_cap )
+      m->text_cap = m->text_cap ? m->text_cap * 2 : 4096;
+    m->text = realloc( m->text, m->text_cap );
+    if ( ! m->text ) err( EX_OSERR, NULL );
+  }
+  memcpy( m->text + m->text_len, s, n );
+  m->text_len += n;
+}
+
+static void kmacro_free( struct kmacro* m )
+{
+  free( m->keys );
+  free( m->text );
+  memset( m, 0, sizeof(struct kmacro) );
+}
+
+void deemacs_kmacro_start( void )
+{
+  kmacro_free( &recording );
+  is_recording = true;
+  command_start = 0;
+}
+
+bool deemacs_kmacro_end( void )
+{
+  if ( ! is_recording )
+    return false;
+  is_recording = false;
+  recording.nkeys = command_start;
+  if ( recording.nkeys == 0 )
+  {
+    kmacro_free( &recording );
+    return false;
+  }
+  kmacro_free( &kmacro );
+  kmacro = recording;
+  memset( &recording, 0, sizeof(struct kmacro) );
+  return true;
+}
+
+bool deemacs_kmacro_recording( void )
+{
+  return is_recording;
+}
+
+void deemacs_kmacro_command_start( void )
+{
+  command_start = recording.nkeys;
+}
+
+bool deemacs_kmacro_defined( void )
+{
+  return kmacro.nkeys > 0;
+}
+
+void deemacs_kmacro_play( void )
+{
+  play_pos = 0;
+  play_text = 0;
+}
+
+bool deemacs_kmacro_done( void )
+{
+  return play_pos < 0 || play_pos >= kmacro.nkeys;
+}
+
+bool deemacs_kmacro_playing( void )
+{
+  return play_pos >= 0;
+}
+
+void deemacs_kmacro_stop( void )
+{
+  play_pos = -1;
+}
+
+// the next key of the macro played
+// A command that reads more keys than the macro has is quit.
+static int32_t play_key( void )
+{
+  if ( play_pos >= kmacro.nkeys )
+    return KBD_CANCEL;
+  int32_t key = kmacro.keys[play_pos++];
+  if ( key == KBD_PASTE )
+  {
+    int64_t n = kmacro.keys[play_pos] | (int64_t) kmacro.keys[play_pos+1] << 31;
+    play_pos += 2;
+    paste_len = 0;
+    for ( int64_t i = 0; i < n; ++i )
+      paste_add( kmacro.text[play_text + i] );
+    play_text += n;
   }
   return key;
 }
+
+int32_t deemacs_next_key( void )
+{
+  if ( play_pos >= 0 )
+    return play_key();
+  int32_t key = read_key();
+  if ( is_recording )
+  {
+    kmacro_add_key( &recording, key );
+    if ( key == KBD_PASTE )
+    {
+      kmacro_add_key( &recording, paste_len & 0x7fffffff );
+      kmacro_add_key( &recording, paste_len >> 31 );
+      kmacro_add_text( &recording, paste, paste_len );
+    }
+  }
+  return key;
+}
+
+bool deemacs_input_pending( void )
+{
+  if ( npending > 0 )
+    return true;
+  // Also with curses look at the tty itself: a getch() and ungetch() per
+  // key would be a read() each.  Bytes curses took already, like those after
+  // an ESC it did not decode, are missed, which only costs a redraw.
+  return raw_wait( 0 ) == 1;
+}
+
+// a key read while polling, true if it is C-g
+static bool poll_key( int32_t key )
+{
+  if ( key == KBD_CANCEL )
+  {
+    npending = 0; //< quitting drops the typeahead
+    return true;
+  }
+  if ( npending < PENDING_MAX )
+    pending[npending++] = key;
+  return false;
+}
+
+bool deemacs_poll_cancel( int timeout_ms )
+{
+  if ( raw_input )
+  {
+    for ( ; raw_wait( timeout_ms ) == 1; timeout_ms = 0 )
+    {
+      if ( poll_key( raw_key() ) )
+        return true;
+    }
+    return false;
+  }
+  timeout( timeout_ms );
+  int c;
+  while ( (c = getch()) != ERR )
+  {
+    int32_t key = codetokey( c );
+    while ( key == KBD_META )
+    {
+      timeout( -1 );
+      key = codetokey( getch() ) | KBD_META;
+    }
+    if ( key == ('[' | KBD_META) )
+    {
+      // a paste is read as a whole like read_key() does
+      if ( paste_start() )
+        poll_key( KBD_PASTE );
+      else if ( pending[npending-1] == KBD_CANCEL )
+        return poll_key( KBD_CANCEL );
+    }
+    else if ( poll_key( key ) )
+      return true;
+    timeout( 0 );
+  }
+  return false;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /* definitions from zile - modifiers */
 #define KBD_CTRL                        01000
@@ -33,9 +34,64 @@
 #define KBD_F10                         00431
 #define KBD_F11                         00432
 #define KBD_F12                         00433
+#define KBD_PASTE                       00434 //< bracketed paste, see deemacs_paste_text()
 
 #define KBD_NOKEY                       03777
 
+#define KBD_ESC_TIMEOUT 50 //< default ms after an ESC for the rest of a sequence, see deemacs_input_raw()
+
+// read keys from the tty with poll() and read() and decode the escape
+// sequences of xterm compatible terminals instead of using curses getch()
+// The rest of a sequence must follow its ESC within esc_timeout_ms, an ESC
+// alone is a meta prefix.  Call after render_init(), curses is only used for
+// output then if at all.
+void deemacs_input_raw( int esc_timeout_ms );
+
 int32_t deemacs_next_key( void );
 
-char* deemacs_key_to_str_representation( int32_t key );
+// wait up to timeout_ms for input during a long operation, true if the user
+// pressed C-g, other keys are kept for deemacs_next_key()
+bool deemacs_poll_cancel( int timeout_ms );
+
+// text of the last KBD_PASTE, line endings are converted to '\n'
+// Valid until the next call of deemacs_next_key().
+const char* deemacs_paste_text( int64_t* len );
+
+// more input is ready to be read without waiting, like typed ahead keys or
+// the rest of a paste
+bool deemacs_input_pending( void );
+
+// Keyboard macros: the keys returned by deemacs_next_key() are recorded
+// and can be played back later as if they were typed again.
+
+// start recording a new macro, the last one is kept until it is done
+void deemacs_kmacro_start( void );
+// stop recording, false if the macro is empty and the last one was kept
+// The keys of the running command, see deemacs_kmacro_command_start(), are
+// not part of the macro.
+bool deemacs_kmacro_end( void );
+bool deemacs_kmacro_recording( void );
+// a command starts reading its keys
+void deemacs_kmacro_command_start( void );
+// a macro was recorded
+bool deemacs_kmacro_defined( void );
+// deemacs_next_key() returns the keys of the last macro from its first one
+// until deemacs_kmacro_stop()
+// Reading past its last key returns KBD_CANCEL, so a command waiting for
+// more keys is quit.
+void deemacs_kmacro_play( void );
+// all keys of the macro were played
+bool deemacs_kmacro_done( void );
+bool deemacs_kmacro_playing( void );
+// deemacs_next_key() reads from the terminal again
+void deemacs_kmacro_stop( void );
+
+// call hook every interval_ms milliseconds while deemacs_next_key() waits
+// for input, hook 0 disables it
+void deemacs_set_idle_hook( void (*hook)( void ), int interval_ms );
+
+// C-M-<backspace> is the longest name with 15 chars
+#define KBD_STR_MAX 16
+
+// name of key like C-x or <f1>
+void deemacs_key_to_str( int32_t key, char res[KBD_STR_MAX] );
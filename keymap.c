@@ -0,0 +1,97 @@
+#include "keymap.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <err.h>
+#include <sysexits.h>
+
+struct keymap* keymap_new( void )
+{
+  struct keymap* km = calloc( 1, sizeof(struct keymap) );
+  if ( ! km ) err( EX_OSERR, NULL );
+  return km;
+}
+
+void keymap_free( struct keymap* km )
+{
+  if ( ! km )
+    return;
+  for ( int k = 0; km->used > 0 && k < KEYMAP_SIZE; ++k )
+  {
+    if ( km->keys[k].prefix || km->keys[k].func )
+      --km->used;
+    keymap_free( km->keys[k].prefix );
+  }
+  free( km );
+}
+
+static void clear_entry( struct keymap* km, int32_t key )
+{
+  struct keymap_entry* e = &km->keys[key];
+  if ( ! e->func && ! e->prefix )
+    return;
+  keymap_free( e->prefix );
+  e->func = 0;
+  e->prefix = 0;
+  e->description = 0;
+  --km->used;
+}
+
+void keymap_bind( struct keymap* km, const int32_t* keys, int n, keymap_fn func, const char* description )
+{
+  assert( n >= 1 && n <= KEYMAP_DEPTH_MAX && func );
+  for ( int i = 0; i < n; ++i )
+  {
+    assert( keys[i] >= 0 && keys[i] < KEYMAP_SIZE );
+    struct keymap_entry* e = &km->keys[keys[i]];
+    if ( i == n - 1 )
+    {
+      clear_entry( km, keys[i] );
+      e->func = func;
+      e->description = description;
+      ++km->used;
+    }
+    else if ( ! e->prefix )
+    {
+      clear_entry( km, keys[i] );
+      e->prefix = keymap_new();
+      ++km->used;
+    }
+    km = e->prefix;
+  }
+}
+
+// unbind keys from km, true if km is empty afterwards
+static bool unbind( struct keymap* km, const int32_t* keys, int n )
+{
+  assert( keys[0] >= 0 && keys[0] < KEYMAP_SIZE );
+  struct keymap_entry* e = &km->keys[keys[0]];
+  if ( n == 1 || ( e->prefix && unbind( e->prefix, keys + 1, n - 1 ) ) )
+    clear_entry( km, keys[0] );
+  return km->used == 0;
+}
+
+void keymap_unbind( struct keymap* km, const int32_t* keys, int n )
+{
+  assert( n >= 1 && n <= KEYMAP_DEPTH_MAX );
+  unbind( km, keys, n );
+}
+
+static void walk( const struct keymap* km, int32_t* keys, int n, void (*fn)( void* ctx, const int32_t* keys, int n, const struct keymap_entry* e ), void* ctx )
+{
+  for ( int k = 0; k < KEYMAP_SIZE; ++k )
+  {
+    const struct keymap_entry* e = &km->keys[k];
+    keys[n] = k;
+    if ( e->func )
+      fn( ctx, keys, n + 1, e );
+    else if ( e->prefix )
+      walk( e->prefix, keys, n + 1, fn, ctx );
+  }
+}
+
+void keymap_walk( const struct keymap* km, void (*fn)( void* ctx, const int32_t* keys, int n, const struct keymap_entry* e ), void* ctx )
+{
+  int32_t keys[KEYMAP_DEPTH_MAX];
+  walk( km, keys, 0, fn, ctx );
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "input.h"
+
+// Key bindings.
+//
+// A keymap is a table indexed directly by the key code, so looking up a key
+// is one array access.  An entry either runs a command or is a prefix key
+// whose entry points to the keymap of the keys that may follow it, like
+// C-x in C-x C-s.  Prefix keymaps can be nested to any depth up to
+// KEYMAP_DEPTH_MAX keys, like C-x 4 f.  Bindings can be changed at any
+// time, prefix keymaps are created and freed as needed.
+
+#define KEYMAP_SIZE (KBD_NOKEY + 1) //< key codes are below this, see input.h
+#define KEYMAP_DEPTH_MAX 8          //< longest key sequence
+
+typedef void (*keymap_fn)( int64_t n ); //< n is the count of the command
+
+struct keymap;
+
+struct keymap_entry
+{
+  keymap_fn func;           //< command, 0 if unbound or a prefix
+  struct keymap* prefix;    //< keymap of the following keys, 0 if not a prefix
+  const char* description;  //< of func, not copied
+};
+
+struct keymap
+{
+  struct keymap_entry keys[KEYMAP_SIZE];
+  int used; //< entries with a command or a prefix
+};
+
+struct keymap* keymap_new( void );
+// free km and its prefix keymaps
+void keymap_free( struct keymap* km );
+
+// bind the sequence of n keys to func, replacing what was bound to it
+// A command bound to one of the leading keys is replaced by a prefix keymap,
+// a prefix keymap bound to the whole sequence is freed.
+void keymap_bind( struct keymap* km, const int32_t* keys, int n, keymap_fn func, const char* description );
+// remove the binding of the sequence of n keys, a prefix keymap left empty
+// is freed, unbinding a prefix key removes all bindings below it
+void keymap_unbind( struct keymap* km, const int32_t* keys, int n );
+
+// entry of key in km, all fields are 0 if it is unbound
+static inline const struct keymap_entry* keymap_lookup( const struct keymap* km, int32_t key )
+{
+  return &km->keys[key & KBD_NOKEY];
+}
+
+// call fn for every command bound in km, ordered by key code
+// keys are the n keys of its sequence.
+void keymap_walk( const struct keymap* km, void (*fn)( void* ctx, const int32_t* keys, int n, const struct keymap_entry* e ), void* ctx );
@@ -0,0 +1,118 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <sysexits.h>
+
+#define PARALLEL_MAX_THREADS 256
+
+int parallel_ncpus( void )
+{
+  long n = sysconf( _SC_NPROCESSORS_ONLN );
+  if ( n < 1 )
+    return 1;
+  return n > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : n;
+}
+
+struct parallel_job
+{
+  void (*fn)( void* ctx, int64_t task );
+  void* ctx;
+  int64_t ntasks;
+  atomic_int_fast64_t next; //< next task to hand out
+
+  // background jobs only
+  atomic_int running; //< workers that did not return yet
+  int nthreads;
+  pthread_t threads[PARALLEL_MAX_THREADS];
+};
+
+static void* parallel_worker( void* arg )
+{
+  struct parallel_job* job = arg;
+  int64_t task;
+  while ( (task = atomic_fetch_add( &job->next, 1 )) < job->ntasks )
+    job->fn( job->ctx, task );
+  return 0;
+}
+
+void parallel_for( int64_t ntasks, void (*fn)( void* ctx, int64_t task ), void* ctx )
+{
+  struct parallel_job job = { fn, ctx, ntasks };
+  atomic_init( &job.next, 0 );
+
+  int nthreads = parallel_ncpus();
+  if ( nthreads > ntasks )
+    nthreads = ntasks;
+
+  // the calling thread is worker 0
+  pthread_t threads[PARALLEL_MAX_THREADS];
+  int started = 0;
+  for ( ; started + 1 < nthreads; ++started )
+  {
+    if ( pthread_create( &threads[started], 0, parallel_worker, &job ) != 0 )
+      break; //< fewer threads are fine
+  }
+  parallel_worker( &job );
+  for ( int i = 0; i < started; ++i )
+  {
+    if ( pthread_join( threads[i], 0 ) != 0 )
+      err( EX_OSERR, NULL );
+  }
+}
+
+static void* background_worker( void* arg )
+{
+  struct parallel_job* job = arg;
+  parallel_worker( job );
+  atomic_fetch_sub( &job->running, 1 );
+  return 0;
+}
+
+struct parallel_job* parallel_start( int64_t ntasks, void (*fn)( void* ctx, int64_t task ), void* ctx )
+{
+  struct parallel_job* job = calloc( 1, sizeof(struct parallel_job) );
+  if ( ! job ) err( EX_OSERR, NULL );
+  job->fn = fn;
+  job->ctx = ctx;
+  job->ntasks = ntasks;
+  atomic_init( &job->next, 0 );
+
+  int nthreads = parallel_ncpus();
+  if ( nthreads > ntasks )
+    nthreads = ntasks;
+  atomic_init( &job->running, nthreads );
+  for ( ; job->nthreads < nthreads; ++job->nthreads )
+  {
+    if ( pthread_create( &job->threads[job->nthreads], 0, background_worker, job ) != 0 )
+      break;
+  }
+  atomic_fetch_sub( &job->running, nthreads - job->nthreads );
+  if ( job->nthreads == 0 && ntasks > 0 )
+  {
+    // no thread at all, run it right here then
+    atomic_fetch_add( &job->running, 1 );
+    background_worker( job );
+  }
+  return job;
+}
+
+bool parallel_done( struct parallel_job* job )
+{
+  return atomic_load( &job->running ) == 0;
+}
+
+void parallel_finish( struct parallel_job* job, bool cancel )
+{
+  if ( cancel )
+    atomic_store( &job->next, job->ntasks );
+  for ( int i = 0; i < job->nthreads; ++i )
+  {
+    if ( pthread_join( job->threads[i], 0 ) != 0 )
+      err( EX_OSERR, NULL );
+  }
+  free( job );
+}
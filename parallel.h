@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Data parallel helpers on top of pthreads.
+
+// number of online cpus, at least 1
+int parallel_ncpus( void );
+
+// run fn( ctx, task ) for task = 0 .. ntasks-1 on up to parallel_ncpus()
+// threads and wait for all of them
+void parallel_for( int64_t ntasks, void (*fn)( void* ctx, int64_t task ), void* ctx );
+
+struct parallel_job;
+
+// like parallel_for() but in the background, the calling thread returns
+// right away and has to call parallel_finish() later
+struct parallel_job* parallel_start( int64_t ntasks, void (*fn)( void* ctx, int64_t task ), void* ctx );
+// all tasks have run
+bool parallel_done( struct parallel_job* job );
+// wait for the job and free it, with cancel tasks that did not start yet are skipped
+void parallel_finish( struct parallel_job* job, bool cancel );
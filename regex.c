@@ -0,0 +1,739 @@
+#include "regex.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <sysexits.h>
+
+// DFA states cached before the cache is flushed, and NFA state indices
+// stored for them
+#define DFA_MAX_STATES 1024
+#define DFA_MAX_POOL (1 << 20)
+#define DFA_TABLE (2 * DFA_MAX_STATES) //< hash table slots, power of two
+
+// syntax tree
+enum node_type { N_SET, N_BOL, N_EOL, N_EMPTY, N_CAT, N_ALT, N_STAR, N_PLUS, N_QUEST };
+
+struct node
+{
+  enum node_type type;
+  int a, b; //< operands, the byte set of N_SET in a
+};
+
+// NFA program, Thompson style
+enum inst_op { I_SET, I_SPLIT, I_JMP, I_BOL, I_EOL, I_MATCH };
+
+struct inst
+{
+  enum inst_op op;
+  int x, y; //< jump targets, the byte set of I_SET in x
+};
+
+struct prog
+{
+  struct inst* code;
+  int len, cap;
+};
+
+struct regex
+{
+  struct node* nodes;
+  int nnodes, nodes_cap;
+  uint8_t (*sets)[32]; //< byte bitmaps
+  int nsets, sets_cap;
+  struct prog fwd; //< the pattern
+  struct prog rev; //< the reversed pattern behind a loop over any byte
+  char* literal;
+  int64_t literal_len;
+  bool fold;
+};
+
+struct parser
+{
+  struct regex* re;
+  const char* p;
+  const char* end;
+  const char* error;
+};
+
+static void* grow( void* p, int* cap, int n, size_t size )
+{
+  if ( n < *cap )
+    return p;
+  *cap = *cap ? *cap * 2 : 16;
+  p = realloc( p, *cap * size );
+  if ( ! p ) err( EX_OSERR, NULL );
+  return p;
+}
+
+static int new_node( struct regex* re, enum node_type type, int a, int b )
+{
+  re->nodes = grow( re->nodes, &re->nodes_cap, re->nnodes, sizeof(struct node) );
+  re->nodes[re->nnodes] = (struct node) { type, a, b };
+  return re->nnodes++;
+}
+
+static int new_set( struct regex* re )
+{
+  re->sets = grow( re->sets, &re->sets_cap, re->nsets, sizeof(re->sets[0]) );
+  memset( re->sets[re->nsets], 0, sizeof(re->sets[0]) );
+  return re->nsets++;
+}
+
+static inline void set_add( uint8_t* set, unsigned char c )
+{
+  set[c >> 3] |= 1 << (c & 7);
+}
+
+static inline bool set_has( const uint8_t* set, unsigned char c )
+{
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+// both cases of the letters in set
+static void set_fold( uint8_t* set )
+{
+  for ( int c = 'a'; c <= 'z'; ++c )
+    if ( set_has( set, c ) || set_has( set, c - 'a' + 'A' ) )
+    {
+      set_add( set, c );
+      set_add( set, c - 'a' + 'A' );
+    }
+}
+
+static int literal_node( struct parser* ps, unsigned char c )
+{
+  int set = new_set( ps->re );
+  set_add( ps->re->sets[set], c );
+  if ( ps->re->fold )
+    set_fold( ps->re->sets[set] );
+  return new_node( ps->re, N_SET, set, 0 );
+}
+
+static bool at( const struct parser* ps, const char* s )
+{
+  return ps->end - ps->p >= 2 && ps->p[0] == s[0] && ps->p[1] == s[1];
+}
+
+// end of an alternative: end of the pattern, \| or \)
+static bool at_alt_end( const struct parser* ps )
+{
+  return ps->p == ps->end || at( ps, "\\|" ) || at( ps, "\\)" );
+}
+
+static int parse_alt( struct parser* ps );
+
+// [...] or [^...], ps->p is behind the [
+static int parse_class( struct parser* ps )
+{
+  int set = new_set( ps->re );
+  bool negate = ps->p < ps->end && *ps->p == '^';
+  if ( negate )
+    ++ps->p;
+  // ] right after [ or [^ is a member
+  for ( bool first = true; ; first = false )
+  {
+    if ( ps->p == ps->end )
+    {
+      ps->error = "Unmatched [ or [^";
+      return -1;
+    }
+    unsigned char c = *ps->p++;
+    if ( c == ']' && ! first )
+      break;
+    unsigned char last = c;
+    if ( ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']' )
+    {
+      last = ps->p[1];
+      ps->p += 2;
+    }
+    for ( int i = c; i <= last; ++i ) //< reversed ranges are empty like in Emacs
+      set_add( ps->re->sets[set], i );
+  }
+  uint8_t* bits = ps->re->sets[set];
+  if ( ps->re->fold )
+    set_fold( bits );
+  if ( negate )
+  {
+    for ( int i = 0; i < 32; ++i )
+      bits[i] = ~bits[i];
+    bits['\n' >> 3] &= ~(1 << ('\n' & 7));
+  }
+  return new_node( ps->re, N_SET, set, 0 );
+}
+
+// single character, class or group
+// ^ is special at the start of an alternative, $ at its end, and repetition
+// operators with nothing to repeat match themselves.
+static int parse_atom( struct parser* ps, bool start )
+{
+  unsigned char c = *ps->p++;
+  if ( c == '^' && start )
+    return new_node( ps->re, N_BOL, 0, 0 );
+  if ( c == '$' && at_alt_end( ps ) )
+    return new_node( ps->re, N_EOL, 0, 0 );
+  if ( c == '.' )
+  {
+    int set = new_set( ps->re );
+    memset( ps->re->sets[set], 0xff, 32 );
+    ps->re->sets[set]['\n' >> 3] &= ~(1 << ('\n' & 7));
+    return new_node( ps->re, N_SET, set, 0 );
+  }
+  if ( c == '[' )
+    return parse_class( ps );
+  if ( c != '\\' )
+    return literal_node( ps, c );
+
+  if ( ps->p == ps->end )
+  {
+    ps->error = "Trailing backslash";
+    return -1;
+  }
+  c = *ps->p++;
+  if ( c == '(' )
+  {
+    int group = parse_alt( ps );
+    if ( group < 0 )
+      return -1;
+    if ( ! at( ps, "\\)" ) )
+    {
+      ps->error = "Unmatched ( or \\(";
+      return -1;
+    }
+    ps->p += 2;
+    return group;
+  }
+  if ( c == 'w' || c == 'W' )
+  {
+    // word constituents, bytes of multibyte characters count as letters
+    int set = new_set( ps->re );
+    uint8_t* bits = ps->re->sets[set];
+    for ( int i = 0; i < 256; ++i )
+      if ( (i >= 'a' && i <= 'z') || (i >= 'A' && i <= 'Z') || (i >= '0' && i <= '9') || i == '_' || i >= 0x80 )
+        set_add( bits, i );
+    if ( c == 'W' )
+    {
+      for ( int i = 0; i < 32; ++i )
+        bits[i] = ~bits[i];
+      bits['\n' >> 3] &= ~(1 << ('\n' & 7));
+    }
+    return new_node( ps->re, N_SET, set, 0 );
+  }
+  return literal_node( ps, c );
+}
+
+// concatenation of atoms with their repetition operators
+static int parse_cat( struct parser* ps )
+{
+  int cat = -1;
+  bool start = true;
+  while ( ! at_alt_end( ps ) )
+  {
+    int atom = parse_atom( ps, start );
+    if ( atom < 0 )
+      return -1;
+    start = ps->re->nodes[atom].type == N_BOL;
+    while ( ! start && ps->p < ps->end && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') )
+    {
+      enum node_type type = *ps->p == '*' ? N_STAR : *ps->p == '+' ? N_PLUS : N_QUEST;
+      atom = new_node( ps->re, type, atom, 0 );
+      ++ps->p;
+    }
+    cat = cat < 0 ? atom : new_node( ps->re, N_CAT, cat, atom );
+  }
+  return cat < 0 ? new_node( ps->re, N_EMPTY, 0, 0 ) : cat;
+}
+
+static int parse_alt( struct parser* ps )
+{
+  int alt = parse_cat( ps );
+  while ( alt >= 0 && at( ps, "\\|" ) )
+  {
+    ps->p += 2;
+    int other = parse_cat( ps );
+    if ( other < 0 )
+      return -1;
+    alt = new_node( ps->re, N_ALT, alt, other );
+  }
+  return alt;
+}
+
+static int emit( struct prog* pg, enum inst_op op, int x, int y )
+{
+  pg->code = grow( pg->code, &pg->cap, pg->len, sizeof(struct inst) );
+  pg->code[pg->len] = (struct inst) { op, x, y };
+  return pg->len++;
+}
+
+// code for node n, concatenations in reverse order with reverse
+static void compile( const struct regex* re, struct prog* pg, int n, bool reverse )
+{
+  const struct node* node = &re->nodes[n];
+  int split, jmp;
+  switch ( node->type )
+  {
+  case N_SET:
+    emit( pg, I_SET, node->a, 0 );
+    break;
+  case N_BOL:
+    emit( pg, I_BOL, 0, 0 );
+    break;
+  case N_EOL:
+    emit( pg, I_EOL, 0, 0 );
+    break;
+  case N_EMPTY:
+    break;
+  case N_CAT:
+    compile( re, pg, reverse ? node->b : node->a, reverse );
+    compile( re, pg, reverse ? node->a : node->b, reverse );
+    break;
+  case N_ALT:
+    split = emit( pg, I_SPLIT, 0, 0 );
+    compile( re, pg, node->a, reverse );
+    jmp = emit( pg, I_JMP, 0, 0 );
+    pg->code[split].x = split + 1;
+    pg->code[split].y = pg->len;
+    compile( re, pg, node->b, reverse );
+    pg->code[jmp].x = pg->len;
+    break;
+  case N_STAR:
+    split = emit( pg, I_SPLIT, 0, 0 );
+    compile( re, pg, node->a, reverse );
+    emit( pg, I_JMP, split, 0 );
+    pg->code[split].x = split + 1;
+    pg->code[split].y = pg->len;
+    break;
+  case N_PLUS:
+    jmp = pg->len;
+    compile( re, pg, node->a, reverse );
+    split = emit( pg, I_SPLIT, jmp, 0 );
+    pg->code[split].y = split + 1;
+    break;
+  case N_QUEST:
+    split = emit( pg, I_SPLIT, 0, 0 );
+    compile( re, pg, node->a, reverse );
+    pg->code[split].x = split + 1;
+    pg->code[split].y = pg->len;
+    break;
+  }
+}
+
+// the byte a set of one character (or one letter in both cases) matches, -1 otherwise
+static int single_char( const struct regex* re, int set )
+{
+  int n = 0, c = -1;
+  for ( int i = 0; i < 256; ++i )
+    if ( set_has( re->sets[set], i ) )
+    {
+      ++n;
+      if ( c < 0 )
+        c = i;
+    }
+  if ( n == 1 )
+    return c;
+  if ( n == 2 && re->fold && c >= 'A' && c <= 'Z' && set_has( re->sets[set], c - 'A' + 'a' ) )
+    return c - 'A' + 'a';
+  return -1;
+}
+
+// collect the runs of single characters every match of n goes through
+static void find_literal( struct regex* re, int n, char* run, int64_t* len )
+{
+  const struct node* node = &re->nodes[n];
+  int c;
+  switch ( node->type )
+  {
+  case N_SET:
+    c = single_char( re, node->a );
+    if ( c < 0 )
+    {
+      *len = 0;
+      return;
+    }
+    run[(*len)++] = c;
+    if ( *len > re->literal_len )
+    {
+      re->literal_len = *len;
+      memcpy( re->literal, run, *len );
+    }
+    break;
+  case N_BOL:
+  case N_EOL:
+  case N_EMPTY:
+    break;
+  case N_CAT:
+    find_literal( re, node->a, run, len );
+    find_literal( re, node->b, run, len );
+    break;
+  case N_PLUS:
+    // the operand is there at least once, but may be followed by more
+    find_literal( re, node->a, run, len );
+    *len = 0;
+    break;
+  default:
+    *len = 0;
+  }
+}
+
+struct regex* regex_compile( const char* pattern, int64_t len, bool fold, const char** error )
+{
+  struct regex* re = calloc( 1, sizeof(struct regex) );
+  if ( ! re ) err( EX_OSERR, NULL );
+  re->fold = fold;
+  struct parser ps = { re, pattern, pattern + len, 0 };
+  int root = parse_alt( &ps );
+  if ( root >= 0 && ps.p != ps.end )
+    ps.error = "Unmatched ) or \\)";
+  if ( ps.error )
+  {
+    *error = ps.error;
+    regex_free( re );
+    return 0;
+  }
+
+  compile( re, &re->fwd, root, false );
+  emit( &re->fwd, I_MATCH, 0, 0 );
+  int any = new_set( re );
+  memset( re->sets[any], 0xff, 32 );
+  emit( &re->rev, I_SPLIT, 3, 1 );
+  emit( &re->rev, I_SET, any, 0 );
+  emit( &re->rev, I_JMP, 0, 0 );
+  compile( re, &re->rev, root, true );
+  emit( &re->rev, I_MATCH, 0, 0 );
+
+  re->literal = malloc( len + 1 );
+  char* run = malloc( len + 1 );
+  if ( ! re->literal || ! run ) err( EX_OSERR, NULL );
+  int64_t run_len = 0;
+  find_literal( re, root, run, &run_len );
+  re->literal[re->literal_len] = 0;
+  free( run );
+  return re;
+}
+
+void regex_free( struct regex* re )
+{
+  if ( ! re )
+    return;
+  free( re->nodes );
+  free( re->sets );
+  free( re->fwd.code );
+  free( re->rev.code );
+  free( re->literal );
+  free( re );
+}
+
+const char* regex_literal( const struct regex* re, int64_t* len )
+{
+  *len = re->literal_len;
+  return re->literal;
+}
+
+// A DFA state is the set of NFA instructions the NFA may be in: byte sets
+// and matches, plus the line start and end assertions that did not hold at
+// the position.  Only one end of the line is still ahead of a scan (the end
+// for the forward program, the start for the reverse one), acc_edge tells if
+// the state matches when the scan reached it.
+struct dfa_state
+{
+  int64_t set;   //< offset of the instructions in the pool
+  int32_t nset;
+  bool acc;      //< a match ends here
+  bool acc_edge; //< a match ends here at the end of the scanned line
+};
+
+// Transitions are one flat table of 256 entries per state, an entry holds
+// the target state times 256 plus DFA_ACC if it accepts.  The scanning
+// loops keep the state as its offset into the table and need one load per
+// byte.
+#define DFA_ACC 1
+#define DFA_UNBUILT -1
+
+struct dfa
+{
+  const struct regex* re;
+  const struct prog* pg;
+  bool reverse;
+  struct dfa_state* states;
+  int32_t* next; //< transitions of all states, DFA_UNBUILT if not built yet
+  int nstates, cap;
+  int32_t* pool;
+  int64_t npool, pool_cap;
+  int32_t table[DFA_TABLE]; //< state of a set by hash, -1 if empty
+  int32_t start[2];         //< start state inside the line and at its edge
+  uint32_t flushes;
+  // scratch space for building states
+  int32_t* stack;
+  int32_t* list;
+  uint32_t* mark;
+  uint32_t gen;
+};
+
+struct regex_cache
+{
+  struct dfa fwd;
+  struct dfa rev;
+};
+
+static void dfa_flush( struct dfa* d )
+{
+  d->nstates = 0;
+  d->npool = 0;
+  memset( d->table, 0xff, sizeof(d->table) );
+  d->start[0] = d->start[1] = -1;
+  ++d->flushes;
+}
+
+static void dfa_init( struct dfa* d, const struct regex* re, const struct prog* pg, bool reverse )
+{
+  memset( d, 0, sizeof(struct dfa) );
+  d->re = re;
+  d->pg = pg;
+  d->reverse = reverse;
+  d->stack = malloc( (2 * pg->len + 2) * sizeof(int32_t) );
+  d->list = malloc( pg->len * sizeof(int32_t) );
+  d->mark = calloc( pg->len, sizeof(uint32_t) );
+  if ( ! d->stack || ! d->list || ! d->mark ) err( EX_OSERR, NULL );
+  dfa_flush( d );
+}
+
+static void dfa_free( struct dfa* d )
+{
+  free( d->states );
+  free( d->next );
+  free( d->pool );
+  free( d->stack );
+  free( d->list );
+  free( d->mark );
+}
+
+// add the instructions reachable from pc without consuming a byte to d->list
+// bol and eol tell if the position is at the start or end of the line.
+static void add_closure( struct dfa* d, int32_t pc, bool bol, bool eol, int* n )
+{
+  int sp = 0;
+  d->stack[sp++] = pc;
+  while ( sp > 0 )
+  {
+    pc = d->stack[--sp];
+    if ( d->mark[pc] == d->gen )
+      continue;
+    d->mark[pc] = d->gen;
+    const struct inst* in = &d->pg->code[pc];
+    switch ( in->op )
+    {
+    case I_SPLIT:
+      d->stack[sp++] = in->y;
+      d->stack[sp++] = in->x;
+      break;
+    case I_JMP:
+      d->stack[sp++] = in->x;
+      break;
+    case I_BOL:
+    case I_EOL:
+      if ( in->op == I_BOL ? bol : eol )
+        d->stack[sp++] = pc + 1;
+      else
+        d->list[(*n)++] = pc;
+      break;
+    case I_SET:
+    case I_MATCH:
+      d->list[(*n)++] = pc;
+      break;
+    }
+  }
+}
+
+static int cmp_int32( const void* a, const void* b )
+{
+  int32_t x = *(const int32_t*) a, y = *(const int32_t*) b;
+  return (x > y) - (x < y);
+}
+
+// the state of the n instructions in d->list, built if it is not cached
+// Returns the state as table entry.
+static int32_t dfa_state( struct dfa* d, int n )
+{
+  qsort( d->list, n, sizeof(int32_t), cmp_int32 );
+  uint32_t h = 2166136261u;
+  for ( int i = 0; i < n; ++i )
+    h = (h ^ (uint32_t) d->list[i]) * 16777619u;
+  uint32_t slot = h & (DFA_TABLE - 1);
+  for ( ; d->table[slot] >= 0; slot = (slot + 1) & (DFA_TABLE - 1) )
+  {
+    const struct dfa_state* st = &d->states[d->table[slot]];
+    if ( st->nset == n && memcmp( d->pool + st->set, d->list, n * sizeof(int32_t) ) == 0 )
+      return d->table[slot] << 8 | (st->acc ? DFA_ACC : 0);
+  }
+
+  // a full cache starts over, this bounds the memory without giving up
+  // linear time: every byte still builds at most one state
+  if ( d->nstates == DFA_MAX_STATES || d->npool + n > DFA_MAX_POOL )
+  {
+    dfa_flush( d );
+    return dfa_state( d, n );
+  }
+  if ( d->nstates == d->cap )
+  {
+    d->cap = d->cap ? d->cap * 2 : 16;
+    d->states = realloc( d->states, d->cap * sizeof(struct dfa_state) );
+    d->next = realloc( d->next, d->cap * 256 * sizeof(int32_t) );
+    if ( ! d->states || ! d->next ) err( EX_OSERR, NULL );
+  }
+  if ( d->npool + n > d->pool_cap )
+  {
+    d->pool_cap = (d->npool + n) * 2;
+    d->pool = realloc( d->pool, d->pool_cap * sizeof(int32_t) );
+    if ( ! d->pool ) err( EX_OSERR, NULL );
+  }
+  struct dfa_state* st = &d->states[d->nstates];
+  memset( d->next + d->nstates * 256, 0xff, 256 * sizeof(int32_t) );
+  st->set = d->npool;
+  st->nset = n;
+  memcpy( d->pool + d->npool, d->list, n * sizeof(int32_t) );
+  d->npool += n;
+
+  st->acc = st->acc_edge = false;
+  for ( int i = 0; i < n; ++i )
+    if ( d->pg->code[d->list[i]].op == I_MATCH )
+      st->acc = st->acc_edge = true;
+  if ( ! st->acc )
+  {
+    // follow the assertions that hold at the end of the scan
+    enum inst_op edge = d->reverse ? I_BOL : I_EOL;
+    int m = 0;
+    ++d->gen;
+    for ( int i = 0; i < n; ++i )
+      if ( d->pg->code[d->pool[st->set + i]].op == edge )
+        add_closure( d, d->pool[st->set + i] + 1, d->reverse, ! d->reverse, &m );
+    for ( int i = 0; i < m; ++i )
+      if ( d->pg->code[d->list[i]].op == I_MATCH )
+        st->acc_edge = true;
+  }
+  d->table[slot] = d->nstates;
+  return d->nstates++ << 8 | (st->acc ? DFA_ACC : 0);
+}
+
+static inline const struct dfa_state* dfa_at( const struct dfa* d, int32_t s )
+{
+  return &d->states[s >> 8];
+}
+
+// state at the start of a scan, edge if it starts at the edge of the line
+// (its start for the forward program, its end for the reverse one)
+static int32_t dfa_start( struct dfa* d, bool edge )
+{
+  if ( d->start[edge] < 0 )
+  {
+    int n = 0;
+    ++d->gen;
+    add_closure( d, 0, ! d->reverse && edge, d->reverse && edge, &n );
+    int32_t s = dfa_state( d, n );
+    d->start[edge] = s;
+  }
+  return d->start[edge];
+}
+
+// state after byte c in state s, not built yet
+static int32_t dfa_build_step( struct dfa* d, int32_t s, unsigned char c )
+{
+  int n = 0;
+  ++d->gen;
+  const struct dfa_state* st = dfa_at( d, s );
+  for ( int i = 0; i < st->nset; ++i )
+  {
+    const struct inst* in = &d->pg->code[d->pool[st->set + i]];
+    if ( in->op == I_SET && set_has( d->re->sets[in->x], c ) )
+      add_closure( d, d->pool[st->set + i] + 1, false, false, &n );
+  }
+  uint32_t flushes = d->flushes;
+  int32_t t = dfa_state( d, n );
+  // s is gone if the cache was flushed
+  if ( d->flushes == flushes )
+    d->next[(s & ~0xff) + c] = t;
+  return t;
+}
+
+// state after byte c in state s
+static inline int32_t dfa_step( struct dfa* d, int32_t s, unsigned char c )
+{
+  int32_t t = d->next[(s & ~0xff) + c];
+  return t != DFA_UNBUILT ? t : dfa_build_step( d, s, c );
+}
+
+struct regex_cache* regex_cache_new( const struct regex* re )
+{
+  struct regex_cache* rc = malloc( sizeof(struct regex_cache) );
+  if ( ! rc ) err( EX_OSERR, NULL );
+  dfa_init( &rc->fwd, re, &re->fwd, false );
+  dfa_init( &rc->rev, re, &re->rev, true );
+  return rc;
+}
+
+void regex_cache_free( struct regex_cache* rc )
+{
+  if ( ! rc )
+    return;
+  dfa_free( &rc->fwd );
+  dfa_free( &rc->rev );
+  free( rc );
+}
+
+// longest match starting at column start
+static int64_t match_end( struct regex_cache* rc, const char* p, int64_t n, int64_t start )
+{
+  struct dfa* d = &rc->fwd;
+  int32_t s = dfa_start( d, start == 0 );
+  int64_t end = -1;
+  for ( int64_t pos = start; ; )
+  {
+    if ( (s & DFA_ACC) || (pos == n && dfa_at( d, s )->acc_edge) )
+      end = pos;
+    if ( pos == n || dfa_at( d, s )->nset == 0 )
+      break;
+    s = dfa_step( d, s, p[pos++] );
+  }
+  return end;
+}
+
+// The reverse program scans the line from its end, it is in an accepting
+// state at the columns where a match starts.
+bool regex_first( struct regex_cache* rc, const char* p, int64_t n, int64_t from, int64_t* start, int64_t* len )
+{
+  if ( from > n )
+    return false;
+  struct dfa* d = &rc->rev;
+  int32_t s = dfa_start( d, true );
+  int64_t best = s & DFA_ACC ? n : -1;
+  for ( int64_t pos = n; pos > from; )
+  {
+    s = dfa_step( d, s, p[--pos] );
+    if ( s & DFA_ACC )
+      best = pos;
+  }
+  if ( from == 0 && dfa_at( d, s )->acc_edge )
+    best = 0;
+  if ( best < 0 )
+    return false;
+  *start = best;
+  *len = match_end( rc, p, n, best ) - best;
+  return true;
+}
+
+bool regex_last( struct regex_cache* rc, const char* p, int64_t n, int64_t before, int64_t* start, int64_t* len )
+{
+  if ( before <= 0 )
+    return false;
+  struct dfa* d = &rc->rev;
+  int32_t s = dfa_start( d, true );
+  int64_t pos = n;
+  while ( ! (pos < before && ((s & DFA_ACC) || (pos == 0 && dfa_at( d, s )->acc_edge))) )
+  {
+    if ( pos == 0 )
+      return false;
+    s = dfa_step( d, s, p[--pos] );
+  }
+  *start = pos;
+  *len = match_end( rc, p, n, pos ) - pos;
+  return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Regular expressions for searching, matched by a lazily built DFA.
+//
+// The syntax is the basic Emacs one: . [...] [^...] * + ? \| \( \) \w \W,
+// ^ at the start and $ at the end of a pattern or group, \ quotes any other
+// character.  Patterns are matched against single lines, leftmost-longest.
+//
+// A pattern is compiled to two NFA programs: the reversed pattern with a
+// loop in front finds all positions where a match starts in one backward
+// pass over a line, the forward pattern then finds the longest match from a
+// start.  Both are run as DFAs whose states are built on demand and kept in
+// a bounded cache, so matching is linear in the length of the line and never
+// backtracks.
+
+struct regex;
+struct regex_cache;
+
+// compile pattern, returns 0 and sets *error if it is invalid or incomplete
+// With fold letters match both cases.
+struct regex* regex_compile( const char* pattern, int64_t len, bool fold, const char** error );
+void regex_free( struct regex* re );
+
+// longest literal every match contains, folded to lower case with fold,
+// empty if there is none
+const char* regex_literal( const struct regex* re, int64_t* len );
+
+// DFA states of re, one cache per thread
+struct regex_cache* regex_cache_new( const struct regex* re );
+void regex_cache_free( struct regex_cache* rc );
+
+// leftmost match in the line of n bytes at p starting at column from or later
+bool regex_first( struct regex_cache* rc, const char* p, int64_t n, int64_t from, int64_t* start, int64_t* len );
+// rightmost match in the line of n bytes at p starting before column before
+bool regex_last( struct regex_cache* rc, const char* p, int64_t n, int64_t before, int64_t* start, int64_t* len );
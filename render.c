@@ -0,0 +1,846 @@
+#define _XOPEN_SOURCE 700 //< wcwidth
+#define _DEFAULT_SOURCE   //< cfmakeraw
+#include "render.h"
+
+#include <curses.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <wchar.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+struct render_ops
+{
+  const char* name;
+  void (*start)( void );
+  void (*end)( void );
+  void (*init_pair)( int pair, enum render_color fg, enum render_color bg );
+  void (*size)( int* rows, int* cols );
+  // not named like the curses calls, those are macros
+  void (*move_to)( int y, int x );
+  void (*put)( const char* s, int n );
+  void (*clear_eol)( void );
+  void (*set_attr)( int attr );
+  void (*clear_attr)( int attr );
+  void (*scroll_rows)( int top, int bottom, int k );
+  int64_t (*flush)( void ); //< bytes written, -1 if unknown
+  void (*beep)( void );
+};
+
+static const struct render_ops* ops;
+static bool started;
+static bool count_stats;
+static struct render_stats stats;
+
+// curses
+
+static bool has_color;
+static int proc_io = -1; //< /proc/self/io to count what curses writes, -1 if not there
+
+// bytes written by this process so far, -1 if unknown
+static int64_t bytes_written( void )
+{
+  char text[512];
+  ssize_t n = proc_io < 0 ? -1 : pread( proc_io, text, sizeof(text) - 1, 0 );
+  if ( n <= 0 )
+    return -1;
+  text[n] = 0;
+  const char* w = strstr( text, "wchar:" );
+  return w ? strtoll( w + 6, 0, 10 ) : -1;
+}
+
+static void curses_start( void )
+{
+  initscr();
+  raw();
+  noecho();
+  nonl();
+  intrflush( stdscr, FALSE );
+  keypad( stdscr, TRUE );
+  idlok( stdscr, TRUE ); //< scroll with insert/delete line, see render_scroll()
+  has_color = has_colors();
+  if ( has_color )
+    start_color();
+  if ( count_stats )
+    proc_io = open( "/proc/self/io", O_RDONLY );
+}
+
+static void curses_end( void )
+{
+  endwin();
+  if ( proc_io >= 0 )
+    close( proc_io );
+  proc_io = -1;
+}
+
+static void curses_init_pair( int pair, enum render_color fg, enum render_color bg )
+{
+  if ( has_color )
+    init_pair( pair, fg, bg );
+}
+
+static void curses_size( int* rows, int* cols )
+{
+  getmaxyx( stdscr, *rows, *cols );
+}
+
+static void curses_move( int y, int x )
+{
+  move( y, x );
+}
+
+static void curses_addnstr( const char* s, int n )
+{
+  addnstr( s, n );
+}
+
+static void curses_clrtoeol( void )
+{
+  clrtoeol();
+}
+
+static attr_t curses_attr( int attr )
+{
+  attr_t a = 0;
+  if ( attr & RENDER_BOLD ) a |= A_BOLD;
+  if ( attr & RENDER_STANDOUT ) a |= A_STANDOUT;
+  if ( attr & RENDER_REVERSE ) a |= A_REVERSE;
+  if ( has_color ) a |= COLOR_PAIR( attr >> 8 );
+  return a;
+}
+
+static void curses_attron( int attr )
+{
+  attron( curses_attr( attr ) );
+}
+
+static void curses_attroff( int attr )
+{
+  attroff( curses_attr( attr ) );
+}
+
+static void curses_scroll( int top, int bottom, int k )
+{
+  setscrreg( top, bottom );
+  scrollok( stdscr, TRUE );
+  scrl( k );
+  scrollok( stdscr, FALSE );
+  setscrreg( 0, LINES - 1 );
+}
+
+static int64_t curses_refresh( void )
+{
+  if ( ! count_stats )
+  {
+    refresh();
+    return -1;
+  }
+  int64_t before = bytes_written();
+  refresh();
+  int64_t after = bytes_written();
+  return before < 0 || after < 0 ? -1 : after - before;
+}
+
+static void curses_beep( void )
+{
+  beep();
+}
+
+static const struct render_ops curses_ops =
+{
+  "curses", curses_start, curses_end, curses_init_pair, curses_size,
+  curses_move, curses_addnstr, curses_clrtoeol, curses_attron, curses_attroff,
+  curses_scroll, curses_refresh, curses_beep
+};
+
+// ansi
+//
+// A cell holds the UTF-8 bytes of one character packed into ch, the first
+// byte lowest.  The right half of a wide character is a cell with ch 0.
+
+#define CELL_BLANK ((struct cell){ ' ', 0 })
+#define DIFF_GAP 5 //< unchanged cells rewritten to join two changes rather than moving the cursor
+#define DIFF_SHIFT 4 //< most cells inserted or deleted in a row by the terminal
+
+struct cell
+{
+  uint32_t ch;
+  uint32_t attr; //< as wide as ch, no padding for memcmp()
+};
+
+static int rows, cols;
+static struct cell* front; //< what the terminal shows
+static struct cell* back;  //< the next frame
+static int cy, cx;         //< drawing position
+static int draw_attr;      //< drawing attributes
+static int term_y = -1, term_x = -1; //< terminal cursor, -1 if unknown
+static int term_attr;           //< terminal attributes
+static bool clear_screen;       //< the terminal content is unknown
+static bool utf8;
+static int pair_fg[RENDER_PAIRS], pair_bg[RENDER_PAIRS];
+static struct termios saved_tio;
+static volatile sig_atomic_t resized;
+
+// scroll of the back grid not sent yet, the terminal can do it cheaper than
+// repainting the rows
+static struct { int top, bottom, k; bool broken; } pending_scroll;
+
+static char* out;
+static int64_t out_len, out_cap;
+
+static void out_bytes( const char* s, int64_t n )
+{
+  if ( out_len + n > out_cap )
+  {
+    out_cap = out_cap ? out_cap * 2 : 16384;
+    if ( out_cap < out_len + n )
+      out_cap = out_len + n;
+    out = realloc( out, out_cap );
+    if ( ! out ) err( EX_OSERR, NULL );
+  }
+  memcpy( out + out_len, s, n );
+  out_len += n;
+}
+
+static void out_str( const char* s )
+{
+  out_bytes( s, strlen( s ) );
+}
+
+static void out_printf( const char* fmt, ... )
+{
+  char s[64];
+  va_list ap;
+  va_start( ap, fmt );
+  int n = vsnprintf( s, sizeof(s), fmt, ap );
+  va_end( ap );
+  out_bytes( s, n );
+}
+
+// write the buffered output to the terminal, returns its length
+static int64_t out_flush( void )
+{
+  int64_t len = out_len;
+  for ( int64_t done = 0; done < out_len; )
+  {
+    ssize_t n = write( STDOUT_FILENO, out + done, out_len - done );
+    if ( n < 0 && errno == EINTR )
+      continue;
+    if ( n < 0 ) err( EX_IOERR, "write" );
+    done += n;
+  }
+  out_len = 0;
+  return len;
+}
+
+static void on_winch( int sig )
+{
+  resized = 1;
+}
+
+static void grid_fill( struct cell* g, int64_t n )
+{
+  for ( int64_t i = 0; i < n; ++i )
+    g[i] = CELL_BLANK;
+}
+
+// query the size of the terminal, the next frame is sent in full
+// The next frame starts blank if the size changed, the caller sees the new
+// size and draws everything.
+static void ansi_resize( void )
+{
+  struct winsize ws;
+  int r = 24, c = 80;
+  resized = 0;
+  if ( ioctl( STDOUT_FILENO, TIOCGWINSZ, &ws ) == 0 && ws.ws_row > 0 && ws.ws_col > 0 )
+  {
+    r = ws.ws_row;
+    c = ws.ws_col;
+  }
+  clear_screen = true;
+  if ( back && r == rows && c == cols )
+    return;
+  rows = r;
+  cols = c;
+  free( front );
+  free( back );
+  front = malloc( (size_t) rows * cols * sizeof(struct cell) );
+  back = malloc( (size_t) rows * cols * sizeof(struct cell) );
+  if ( ! front || ! back ) err( EX_OSERR, NULL );
+  grid_fill( front, (int64_t) rows * cols );
+  grid_fill( back, (int64_t) rows * cols );
+  pending_scroll.k = 0;
+  pending_scroll.broken = false;
+  if ( cy >= rows ) cy = rows - 1;
+  if ( cx >= cols ) cx = cols - 1;
+}
+
+static void ansi_start( void )
+{
+  if ( tcgetattr( STDIN_FILENO, &saved_tio ) < 0 ) err( EX_IOERR, "tcgetattr" );
+  struct termios tio = saved_tio;
+  cfmakeraw( &tio );
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  if ( tcsetattr( STDIN_FILENO, TCSANOW, &tio ) < 0 ) err( EX_IOERR, "tcsetattr" );
+
+  // no SA_RESTART, a resize interrupts waiting for input, see raw_wait()
+  struct sigaction sa;
+  memset( &sa, 0, sizeof(sa) );
+  sa.sa_handler = on_winch;
+  sigemptyset( &sa.sa_mask );
+  sigaction( SIGWINCH, &sa, 0 );
+
+  utf8 = MB_CUR_MAX > 1;
+  for ( int i = 0; i < RENDER_PAIRS; ++i )
+    pair_fg[i] = pair_bg[i] = -1;
+  out_str( "\033[?1049h" ); //< alternate screen
+  ansi_resize();
+}
+
+static void ansi_end( void )
+{
+  signal( SIGWINCH, SIG_DFL );
+  out_str( "\033[0m\033[?25h\033[?1049l" );
+  out_flush();
+  tcsetattr( STDIN_FILENO, TCSANOW, &saved_tio );
+  free( front );
+  free( back );
+  free( out );
+  front = back = 0;
+  out = 0;
+  out_cap = 0;
+}
+
+static void ansi_init_pair( int pair, enum render_color fg, enum render_color bg )
+{
+  if ( pair > 0 && pair < RENDER_PAIRS )
+  {
+    pair_fg[pair] = fg;
+    pair_bg[pair] = bg;
+  }
+}
+
+static void ansi_size( int* r, int* c )
+{
+  if ( resized )
+    ansi_resize();
+  *r = rows;
+  *c = cols;
+}
+
+static void ansi_move( int y, int x )
+{
+  cy = y < 0 ? 0 : y < rows ? y : rows - 1;
+  cx = x < 0 ? 0 : x < cols ? x : cols - 1;
+}
+
+// put ch at the drawing position, width 1 or 2
+static void put_cell( uint32_t ch, int width )
+{
+  if ( cx + width > cols )
+  {
+    cx = cols;
+    return;
+  }
+  struct cell* row = back + (int64_t) cy * cols;
+  // do not leave half of a wide character behind
+  if ( row[cx].ch == 0 && cx > 0 )
+    row[cx - 1] = CELL_BLANK;
+  if ( cx + width < cols && row[cx + width].ch == 0 )
+    row[cx + width] = CELL_BLANK;
+  row[cx] = (struct cell){ ch, draw_attr };
+  if ( width == 2 )
+    row[cx + 1] = (struct cell){ 0, draw_attr };
+  cx += width;
+}
+
+// length of the UTF-8 character at s of at most n bytes, 0 if invalid
+static int utf8_char( const unsigned char* s, int n, uint32_t* cp )
+{
+  int len = s[0] >= 0xf5 ? 0 : s[0] >= 0xf0 ? 4 : s[0] >= 0xe0 ? 3 : s[0] >= 0xc2 ? 2 : 0;
+  if ( len == 0 || len > n )
+    return 0;
+  *cp = s[0] & (0x7f >> len);
+  for ( int i = 1; i < len; ++i )
+  {
+    if ( (s[i] & 0xc0) != 0x80 )
+      return 0;
+    *cp = *cp << 6 | (s[i] & 0x3f);
+  }
+  return len;
+}
+
+static void ansi_addnstr( const char* str, int n )
+{
+  const unsigned char* s = (const unsigned char*) str;
+  if ( n < 0 )
+    n = strlen( str );
+  for ( int i = 0; i < n && cx < cols; ++i )
+  {
+    unsigned char c = s[i];
+    if ( c == '\t' )
+    {
+      do put_cell( ' ', 1 ); while ( cx % 8 != 0 && cx < cols );
+    }
+    else if ( c < 0x20 || c == 0x7f )
+    {
+      put_cell( '^', 1 );
+      put_cell( c ^ 0x40, 1 );
+    }
+    else if ( c < 0x80 )
+      put_cell( c, 1 );
+    else
+    {
+      uint32_t cp;
+      int len = utf8 ? utf8_char( s + i, n - i, &cp ) : 0;
+      int width = len ? wcwidth( cp ) : -1;
+      if ( width < 1 || width > 2 )
+      {
+        put_cell( '?', 1 ); //< also combining characters, cells are never empty
+        continue;
+      }
+      uint32_t ch = 0;
+      for ( int k = len - 1; k >= 0; --k )
+        ch = ch << 8 | s[i + k];
+      put_cell( ch, width );
+      i += len - 1;
+    }
+  }
+}
+
+static void ansi_clrtoeol( void )
+{
+  struct cell* row = back + (int64_t) cy * cols;
+  if ( cx > 0 && cx < cols && row[cx].ch == 0 )
+    row[cx - 1] = CELL_BLANK;
+  for ( int x = cx; x < cols; ++x )
+    row[x] = CELL_BLANK;
+}
+
+static void ansi_attron( int a )
+{
+  draw_attr |= a;
+}
+
+static void ansi_attroff( int a )
+{
+  draw_attr &= ~a;
+}
+
+// move the rows top..bottom of g by k
+static void grid_scroll( struct cell* g, int top, int bottom, int k )
+{
+  int n = bottom - top + 1;
+  int64_t row = cols * sizeof(struct cell);
+  if ( k > 0 )
+  {
+    memmove( g + (int64_t) top * cols, g + (int64_t) (top + k) * cols, (n - k) * row );
+    grid_fill( g + (int64_t) (bottom - k + 1) * cols, (int64_t) k * cols );
+  }
+  else
+  {
+    memmove( g + (int64_t) (top - k) * cols, g + (int64_t) top * cols, (n + k) * row );
+    grid_fill( g + (int64_t) top * cols, (int64_t) -k * cols );
+  }
+}
+
+static void ansi_scroll( int top, int bottom, int k )
+{
+  if ( top < 0 ) top = 0;
+  if ( bottom >= rows ) bottom = rows - 1;
+  int n = bottom - top + 1;
+  if ( k == 0 || n <= 0 )
+    return;
+  if ( k >= n || -k >= n )
+  {
+    grid_fill( back + (int64_t) top * cols, (int64_t) n * cols );
+    pending_scroll.broken = true;
+    return;
+  }
+  grid_scroll( back, top, bottom, k );
+  // one scroll per frame is sent, the diff repaints anything else
+  if ( pending_scroll.k == 0 )
+  {
+    pending_scroll.top = top;
+    pending_scroll.bottom = bottom;
+  }
+  if ( pending_scroll.top != top || pending_scroll.bottom != bottom )
+    pending_scroll.broken = true;
+  pending_scroll.k += k;
+  if ( pending_scroll.k >= n || -pending_scroll.k >= n )
+    pending_scroll.broken = true;
+}
+
+static void out_attr( int a )
+{
+  if ( a == term_attr )
+    return;
+  term_attr = a;
+  out_str( "\033[0" );
+  if ( a & RENDER_BOLD )
+    out_str( ";1" );
+  if ( a & (RENDER_STANDOUT | RENDER_REVERSE) )
+    out_str( ";7" );
+  int pair = a >> 8;
+  if ( pair > 0 && pair < RENDER_PAIRS )
+  {
+    if ( pair_fg[pair] >= 0 )
+      out_printf( pair_fg[pair] == RENDER_GREY ? ";90" : ";3%d", pair_fg[pair] );
+    if ( pair_bg[pair] >= 0 )
+      out_printf( pair_bg[pair] == RENDER_GREY ? ";100" : ";4%d", pair_bg[pair] );
+  }
+  out_str( "m" );
+}
+
+static void out_move( int y, int x )
+{
+  if ( term_y == y && term_x == x )
+    return;
+  // the shortest sequence that gets there
+  if ( term_y >= 0 && y == term_y + 1 && x == 0 )
+    out_str( "\r\n" ); //< the scroll region is the whole screen, this never scrolls
+  else if ( term_y == y )
+    out_printf( "\033[%dG", x + 1 );
+  else if ( term_x == x )
+    out_printf( "\033[%dd", y + 1 );
+  else if ( x == 0 )
+    out_printf( "\033[%dH", y + 1 );
+  else
+    out_printf( "\033[%d;%dH", y + 1, x + 1 );
+  term_y = y;
+  term_x = x;
+}
+
+static bool cell_eq( const struct cell* a, const struct cell* b )
+{
+  return a->ch == b->ch && a->attr == b->attr;
+}
+
+static bool cell_blank( const struct cell* c )
+{
+  return c->ch == ' ' && c->attr == 0;
+}
+
+// are the cells of row r from x on blank
+static bool row_blank( const struct cell* r, int x )
+{
+  for ( ; x < cols; ++x )
+    if ( ! cell_blank( &r[x] ) )
+      return false;
+  return true;
+}
+
+// scroll the rows top..bottom of the terminal and the front grid by k
+static void scroll_terminal( int top, int bottom, int k )
+{
+  out_attr( 0 ); //< the rows moved in get the current background
+  out_printf( "\033[%d;%dr", top + 1, bottom + 1 );
+  // a line feed at the bottom margin scrolls up, a reverse index at the top down
+  out_printf( "\033[%dH", k > 0 ? bottom + 1 : top + 1 );
+  for ( int i = 0; i < k; ++i )
+    out_str( "\n" );
+  for ( int i = 0; i < -k; ++i )
+    out_str( "\033M" );
+  out_str( "\033[r" ); //< also homes the cursor
+  term_y = term_x = 0;
+  grid_scroll( front, top, bottom, k );
+}
+
+// send the scroll of the back grid, false if there is none
+static bool send_scroll( void )
+{
+  int top = pending_scroll.top, bottom = pending_scroll.bottom, k = pending_scroll.k;
+  bool broken = pending_scroll.broken;
+  pending_scroll.k = 0;
+  pending_scroll.broken = false;
+  // a byte per row moved away, keeping just a few rows does not pay
+  if ( k == 0 || broken || bottom - top + 1 - abs( k ) < 4 )
+    return false;
+  scroll_terminal( top, bottom, k );
+  return true;
+}
+
+static bool row_eq( int y1, int y2 )
+{
+  return memcmp( back + (int64_t) y1 * cols, front + (int64_t) y2 * cols, cols * sizeof(struct cell) ) == 0;
+}
+
+// Lines inserted or deleted without a scroll of the caller, like joining
+// two lines, move the rows below them by a few.  Find the run of rows
+// which moved by up to DIFF_SHIFT and saves the most rows to send, and
+// scroll it.
+static void find_scroll( void )
+{
+  int changed = 0;
+  for ( int y = 0; y < rows; ++y )
+    changed += ! row_eq( y, y );
+  if ( changed < 2 )
+    return;
+  int best = 1, best_y = 0, best_n = 0, best_k = 0;
+  for ( int k = -DIFF_SHIFT; k <= DIFF_SHIFT; ++k )
+  {
+    if ( k == 0 )
+      continue;
+    for ( int y = k < 0 ? -k : 0; y < rows && y + k < rows; )
+    {
+      int n = 0, saved = 0;
+      for ( ; y + n < rows && y + n + k < rows && row_eq( y + n, y + n + k ); ++n )
+      {
+        if ( ! row_eq( y + n, y + n ) && ! row_blank( back + (int64_t) (y + n) * cols, 0 ) )
+          ++saved;
+      }
+      if ( saved > best )
+      {
+        best = saved;
+        best_y = y;
+        best_n = n;
+        best_k = k;
+      }
+      y += n + 1;
+    }
+  }
+  // the rows best_y.. get the front rows best_y+k..
+  if ( best_k > 0 )
+    scroll_terminal( best_y, best_y + best_n - 1 + best_k, best_k );
+  else if ( best_k < 0 )
+    scroll_terminal( best_y + best_k, best_y + best_n - 1, best_k );
+}
+
+static void out_cell( const struct cell* c )
+{
+  for ( uint32_t ch = c->ch; ch; ch >>= 8 )
+  {
+    char b = ch & 0xff;
+    out_bytes( &b, 1 );
+  }
+}
+
+// a few cells inserted or deleted at x, like typing in the middle of a
+// line: let the terminal shift the rest of the row instead of sending it
+// again, the cursor is at x
+static void shift_row( struct cell* f, const struct cell* b, int x )
+{
+  int64_t sz = sizeof(struct cell);
+  for ( int d = 1; d <= DIFF_SHIFT && x + d < cols; ++d )
+  {
+    if ( memcmp( b + x + d, f + x, (cols - x - d) * sz ) == 0 && ! row_blank( b, x + d ) )
+    {
+      out_attr( 0 ); //< the inserted cells get the current background
+      out_printf( "\033[%d@", d );
+      memmove( f + x + d, f + x, (cols - x - d) * sz );
+      grid_fill( f + x, d );
+      return;
+    }
+    if ( memcmp( b + x, f + x + d, (cols - x - d) * sz ) == 0 && ! row_blank( b, x ) )
+    {
+      out_attr( 0 ); //< the cells moved in at the end get the current background
+      out_printf( "\033[%dP", d );
+      memmove( f + x, f + x + d, (cols - x - d) * sz );
+      grid_fill( f + cols - d, d );
+      return;
+    }
+  }
+}
+
+// send the changed cells of row y
+static void diff_row( int y )
+{
+  struct cell* f = front + (int64_t) y * cols;
+  const struct cell* b = back + (int64_t) y * cols;
+  if ( memcmp( f, b, cols * sizeof(struct cell) ) == 0 )
+    return;
+  int blank = cols; //< cells from here on are blank in the next frame
+  while ( blank > 0 && cell_blank( &b[blank - 1] ) )
+    --blank;
+
+  int x = 0;
+  while ( 1 )
+  {
+    while ( x < cols && cell_eq( &f[x], &b[x] ) )
+      ++x;
+    if ( x == cols )
+      return;
+    // start at the left half of a wide character
+    while ( x > 0 && (b[x].ch == 0 || f[x].ch == 0) )
+      --x;
+    out_move( y, x );
+    shift_row( f, b, x );
+    while ( x < cols )
+    {
+      if ( x >= blank )
+      {
+        if ( ! row_blank( f, x ) )
+        {
+          out_attr( 0 );
+          out_str( "\033[K" );
+        }
+        for ( ; x < cols; ++x )
+          f[x] = b[x];
+        return;
+      }
+      if ( b[x].ch != 0 && cell_eq( &f[x], &b[x] ) )
+      {
+        // rewrite a short run of unchanged cells to reach the next change
+        int gap = x;
+        while ( gap < cols && gap - x <= DIFF_GAP && cell_eq( &f[gap], &b[gap] ) )
+          ++gap;
+        if ( gap == cols || gap - x > DIFF_GAP )
+          break;
+      }
+      if ( b[x].ch != 0 )
+      {
+        out_attr( b[x].attr );
+        out_cell( &b[x] );
+      }
+      f[x] = b[x];
+      ++x;
+      ++term_x;
+    }
+    if ( term_x >= cols )
+      term_x = -1; //< the cursor waits at the margin, where it goes next depends on the terminal
+  }
+}
+
+static int64_t ansi_refresh( void )
+{
+  if ( resized )
+    ansi_resize();
+  if ( clear_screen )
+  {
+    out_attr( 0 );
+    out_str( "\033[H\033[2J" );
+    term_y = term_x = 0;
+    grid_fill( front, (int64_t) rows * cols );
+    clear_screen = false;
+    pending_scroll.k = 0;
+    pending_scroll.broken = false;
+  }
+  if ( ! send_scroll() )
+    find_scroll();
+  for ( int y = 0; y < rows; ++y )
+    diff_row( y );
+  out_move( cy, cx );
+  return out_flush();
+}
+
+static void ansi_beep( void )
+{
+  out_str( "\a" );
+  out_flush();
+}
+
+static const struct render_ops ansi_ops =
+{
+  "ansi", ansi_start, ansi_end, ansi_init_pair, ansi_size,
+  ansi_move, ansi_addnstr, ansi_clrtoeol, ansi_attron, ansi_attroff,
+  ansi_scroll, ansi_refresh, ansi_beep
+};
+
+void render_init( enum render_backend backend, bool with_stats )
+{
+  ops = backend == RENDER_ANSI ? &ansi_ops : &curses_ops;
+  count_stats = with_stats;
+  ops->start();
+  started = true;
+}
+
+void render_end( void )
+{
+  if ( ! started )
+    return;
+  started = false;
+  ops->end();
+}
+
+const char* render_name( void )
+{
+  return ops ? ops->name : "none";
+}
+
+void render_init_pair( int pair, enum render_color fg, enum render_color bg )
+{
+  ops->init_pair( pair, fg, bg );
+}
+
+void render_size( int* r, int* c )
+{
+  ops->size( r, c );
+}
+
+void render_move( int y, int x )
+{
+  ops->move_to( y, x );
+}
+
+void render_addnstr( const char* s, int n )
+{
+  ops->put( s, n );
+}
+
+void render_printw( const char* fmt, ... )
+{
+  char s[512];
+  va_list ap;
+  va_start( ap, fmt );
+  vsnprintf( s, sizeof(s), fmt, ap );
+  va_end( ap );
+  ops->put( s, -1 );
+}
+
+void render_clrtoeol( void )
+{
+  ops->clear_eol();
+}
+
+void render_attron( int attr )
+{
+  ops->set_attr( attr );
+}
+
+void render_attroff( int attr )
+{
+  ops->clear_attr( attr );
+}
+
+void render_scroll( int top, int bottom, int k )
+{
+  ops->scroll_rows( top, bottom, k );
+}
+
+void render_refresh( void )
+{
+  if ( ! count_stats )
+  {
+    ops->flush();
+    return;
+  }
+  struct timespec t0, t1;
+  clock_gettime( CLOCK_MONOTONIC, &t0 );
+  int64_t bytes = ops->flush();
+  clock_gettime( CLOCK_MONOTONIC, &t1 );
+  if ( bytes == 0 )
+    return; //< nothing changed, not a frame
+  ++stats.frames;
+  stats.time_ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+  stats.bytes = bytes < 0 || stats.bytes < 0 ? -1 : stats.bytes + bytes;
+}
+
+void render_beep( void )
+{
+  ops->beep();
+}
+
+void render_stats( struct render_stats* s )
+{
+  *s = stats;
+}
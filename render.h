@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Screen output.
+//
+// The editor draws through these calls instead of curses so the backend can
+// be chosen at startup.  RENDER_CURSES passes them on to curses.
+// RENDER_ANSI keeps the screen as a grid of cells, one for what the terminal
+// shows and one for the next frame.  render_refresh() compares them row by
+// row and sends only the changed cells with xterm compatible escape
+// sequences in a single write().  It does not read keys, use it with
+// deemacs_input_raw().
+//
+// Like curses, drawing goes to a position moved by render_move() and the
+// text written, the terminal cursor is put there by render_refresh().
+
+enum render_backend
+{
+  RENDER_CURSES,
+  RENDER_ANSI
+};
+
+// attributes for render_attron() and render_attroff()
+#define RENDER_BOLD     0x01
+#define RENDER_STANDOUT 0x02
+#define RENDER_REVERSE  0x04
+#define RENDER_COLOR(pair) ((pair) << 8) //< pair 1..RENDER_PAIRS-1, see render_init_pair()
+#define RENDER_PAIRS 8
+
+// colors for render_init_pair(), the ansi numbers
+enum render_color
+{
+  RENDER_BLACK, RENDER_RED, RENDER_GREEN, RENDER_YELLOW,
+  RENDER_BLUE, RENDER_MAGENTA, RENDER_CYAN, RENDER_WHITE,
+  RENDER_GREY
+};
+
+// output statistics, see render_stats()
+struct render_stats
+{
+  int64_t frames;  //< render_refresh() calls that changed the screen
+  int64_t bytes;   //< written to the terminal by them, -1 if unknown
+  int64_t time_ns; //< spent in them
+};
+
+// take over the terminal: raw mode, no echo, the whole screen cleared
+// With stats, render_stats() counts the output, which costs a little time
+// per frame with RENDER_CURSES.
+void render_init( enum render_backend backend, bool stats );
+// give the terminal back, can be called more than once
+void render_end( void );
+// "curses" or "ansi"
+const char* render_name( void );
+
+// foreground and background of the color pair, ignored without colors
+void render_init_pair( int pair, enum render_color fg, enum render_color bg );
+
+// current size of the terminal, picks up a resize
+void render_size( int* rows, int* cols );
+
+void render_move( int y, int x );
+// the first n bytes of s, all if n < 0, at the position which is moved behind
+// them, cut at the end of the row
+// Tabs and control characters are shown like curses does.
+void render_addnstr( const char* s, int n );
+static inline void render_mvaddnstr( int y, int x, const char* s, int n ) { render_move( y, x ); render_addnstr( s, n ); }
+static inline void render_mvaddstr( int y, int x, const char* s ) { render_mvaddnstr( y, x, s, -1 ); }
+void render_printw( const char* fmt, ... );
+// clear from the position to the end of its row
+void render_clrtoeol( void );
+
+void render_attron( int attr );
+void render_attroff( int attr );
+
+// move the rows top..bottom up by k, down if k < 0, the rows moved in are blank
+void render_scroll( int top, int bottom, int k );
+
+// show what was drawn since the last call
+void render_refresh( void );
+void render_beep( void );
+
+void render_stats( struct render_stats* stats );
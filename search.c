@@ -0,0 +1,677 @@
+#include "search.h"
+#include "textbuf.h"
+#include "simd.h"
+#include "parallel.h"
+#include "regex.h"
+#include "trigram.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <err.h>
+#include <sysexits.h>
+
+static inline char fold_char( char c )
+{
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static inline char upper_char( char c )
+{
+  return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+}
+
+void search_init( struct search* s, const char* needle, int64_t len )
+{
+  s->len = len;
+  s->needle = malloc( len + 1 );
+  if ( ! s->needle ) err( EX_OSERR, NULL );
+  s->fold = true;
+  s->single = true;
+  s->re = 0;
+  for ( int64_t i = 0; i < len; ++i )
+  {
+    if ( needle[i] >= 'A' && needle[i] <= 'Z' )
+      s->fold = false;
+    if ( needle[i] == '\n' || needle[i] == '\r' )
+      s->single = false;
+  }
+  for ( int64_t i = 0; i < len; ++i )
+    s->needle[i] = s->fold ? fold_char( needle[i] ) : needle[i];
+  s->needle[len] = 0;
+
+  if ( len > 0 )
+  {
+    s->first[0] = s->first[1] = s->needle[0];
+    s->last[0] = s->last[1] = s->needle[len-1];
+    if ( s->fold )
+    {
+      s->first[1] = upper_char( s->first[0] );
+      s->last[1] = upper_char( s->last[0] );
+    }
+  }
+}
+
+const char* search_init_regex( struct search* s, const char* pattern, int64_t len )
+{
+  // upper case letters quoted by a backslash are operators like \W
+  bool fold = true;
+  for ( int64_t i = 0; i < len; ++i )
+  {
+    if ( pattern[i] == '\\' )
+      ++i;
+    else if ( pattern[i] >= 'A' && pattern[i] <= 'Z' )
+      fold = false;
+  }
+  const char* error = 0;
+  struct regex* re = regex_compile( pattern, len, fold, &error );
+  int64_t n = 0;
+  const char* literal = re ? regex_literal( re, &n ) : "";
+  search_init( s, literal, n );
+  s->re = re;
+  return error;
+}
+
+void search_free( struct search* s )
+{
+  free( s->needle );
+  regex_free( s->re );
+  s->needle = 0;
+  s->re = 0;
+  s->len = 0;
+}
+
+// the inner bytes of the needle match at p, first and last were checked by the filter
+static bool match_inner( const struct search* s, const char* p )
+{
+  if ( ! s->fold )
+    return memcmp( p + 1, s->needle + 1, s->len - 2 ) == 0;
+  for ( int64_t i = 1; i + 1 < s->len; ++i )
+    if ( fold_char( p[i] ) != s->needle[i] )
+      return false;
+  return true;
+}
+
+const char* search_mem( const struct search* s, const char* p, int64_t n )
+{
+  if ( s->len == 0 )
+    return p;
+  const char* end = p + n;
+  while ( end - p >= s->len )
+  {
+    const char* cand = simd_find_pair( p, end - p, s->first, s->last, s->len - 1 );
+    if ( ! cand )
+      return 0;
+    if ( s->len <= 2 || match_inner( s, cand ) )
+      return cand;
+    p = cand + 1;
+  }
+  return 0;
+}
+
+const char* search_mem_rev( const struct search* s, const char* p, int64_t n )
+{
+  if ( s->len == 0 )
+    return p + n;
+  while ( n >= s->len )
+  {
+    const char* cand = simd_rfind_pair( p, n, s->first, s->last, s->len - 1 );
+    if ( ! cand )
+      return 0;
+    if ( s->len <= 2 || match_inner( s, cand ) )
+      return cand;
+    n = cand - p + s->len - 1; //< only candidates before cand
+  }
+  return 0;
+}
+
+// first regexp match in the n bytes of whole lines at p, in the first line
+// from column c on
+static const char* regex_mem( const struct search* s, struct regex_cache* rc, const char* p, int64_t n, int64_t c, int64_t* len )
+{
+  const char* end = p + n;
+  const char* bol = p;
+  while ( 1 )
+  {
+    // only lines with the literal can match
+    if ( s->len > 0 )
+    {
+      const char* lit = search_mem( s, bol + c, end - bol - c );
+      if ( ! lit )
+        return 0;
+      const char* b = lit;
+      while ( b > bol && b[-1] != '\n' )
+        --b;
+      if ( b != bol )
+      {
+        bol = b;
+        c = 0;
+      }
+    }
+    const char* eol = simd_memchr( bol, '\n', end - bol );
+    if ( ! eol )
+      eol = end;
+    // CR of CRLF line endings is not part of the line
+    int64_t line_len = eol - bol;
+    if ( eol < end && line_len > 0 && bol[line_len-1] == '\r' )
+      --line_len;
+    int64_t start;
+    if ( regex_first( rc, bol, line_len, c, &start, len ) )
+      return bol + start;
+    if ( eol == end )
+      return 0;
+    bol = eol + 1;
+    c = 0;
+  }
+}
+
+// last regexp match in the n bytes of whole lines at p, in the last line
+// starting before column c
+static const char* regex_mem_rev( const struct search* s, struct regex_cache* rc, const char* p, int64_t n, int64_t c, int64_t* len )
+{
+  const char* end = p + n;
+  const char* eol = end;
+  while ( 1 )
+  {
+    if ( s->len > 0 )
+    {
+      const char* lit = search_mem_rev( s, p, eol - p );
+      if ( ! lit )
+        return 0;
+      const char* e = simd_memchr( lit, '\n', eol - lit );
+      if ( e )
+      {
+        eol = e;
+        c = INT64_MAX;
+      }
+    }
+    const char* bol = eol;
+    while ( bol > p && bol[-1] != '\n' )
+      --bol;
+    int64_t line_len = eol - bol;
+    if ( eol < end && line_len > 0 && bol[line_len-1] == '\r' )
+      --line_len;
+    int64_t start;
+    if ( regex_last( rc, bol, line_len, c, &start, len ) )
+      return bol + start;
+    if ( bol == p )
+      return 0;
+    eol = bol - 1;
+    c = INT64_MAX;
+  }
+}
+
+// A job splits the lines into chunks that are numbered in search order,
+// chunk 0 holds the start position.  Workers take chunks in that order and
+// give up on a chunk as soon as an earlier one has a match, so the match
+// of the first chunk with one is the first match in search order.
+struct search_job
+{
+  const struct search* s;
+  const struct textbuf* tb;
+  bool backward;
+  int64_t r, c;    //< start position
+  int64_t lines;   //< per chunk
+  int64_t nchunks;
+  atomic_int_fast64_t best; //< first chunk with a match, nchunks if none
+  atomic_bool cancel;
+  struct search_hit* hits; //< match of each chunk with one
+  struct parallel_job* workers; //< chunks 1 .., 0 if not started
+};
+
+static bool job_stopped( struct search_job* job, int64_t chunk )
+{
+  return job && (atomic_load( &job->best ) < chunk || atomic_load( &job->cancel ));
+}
+
+// bytes per run, with a trigram index runs are about one block so that
+// blocks without the needle are skipped
+static int64_t run_max( const struct search* s, const struct textbuf* tb )
+{
+  if ( ! s->single )
+    return 0;
+  return tb->trigrams && trigram_ready( tb->trigrams ) ? TRIGRAM_BLOCK : SEARCH_RUN_MAX;
+}
+
+// the run may have a match, false if the trigram index rules it out
+static bool run_may_match( const struct search* s, const struct textbuf* tb, const struct tb_run* run )
+{
+  return ! tb->trigrams || ! s->single || trigram_may_contain( tb->trigrams, run->p, run->len, s->needle, s->len );
+}
+
+// first match in the lines r .. end-1 starting at column c of line r
+// A regexp search needs the DFA states rc, they are built while matching.
+static bool scan_forward( const struct search* s, struct regex_cache* rc, const struct textbuf* tb, int64_t r, int64_t c,
+                          int64_t end, struct search_job* job, int64_t chunk, struct search_hit* hit )
+{
+  struct tb_iter it;
+  tb_iter_at( tb, r, &it );
+  if ( tb_iter_valid( &it ) && c > line_len( tb_iter_line( &it ) ) )
+  {
+    tb_iter_next( &it );
+    ++r;
+    c = 0;
+  }
+  while ( tb_iter_valid( &it ) && r < end && ! job_stopped( job, chunk ) )
+  {
+    struct tb_run run;
+    tb_iter_run( &it, run_max( s, tb ), end - r, &run );
+    if ( ! run_may_match( s, tb, &run ) )
+    {
+      r += run.nlines;
+      c = 0;
+      continue;
+    }
+    int64_t len = s->len;
+    const char* match = rc ? regex_mem( s, rc, run.p, run.len, c, &len ) : search_mem( s, run.p + c, run.len - c );
+    if ( match )
+    {
+      // the match is in the line after the last line ending before it
+      const char* bol = match;
+      while ( bol > run.p && bol[-1] != '\n' )
+        --bol;
+      hit->r = r + simd_count( run.p, '\n', bol - run.p );
+      hit->c = match - bol;
+      hit->len = len;
+      return true;
+    }
+    r += run.nlines;
+    c = 0;
+  }
+  return false;
+}
+
+// last match in the lines begin .. r starting before column c of line r
+static bool scan_backward( const struct search* s, struct regex_cache* rc, const struct textbuf* tb, int64_t r, int64_t c,
+                           int64_t begin, struct search_job* job, int64_t chunk, struct search_hit* hit )
+{
+  struct tb_iter it;
+  tb_iter_at( tb, r, &it );
+  if ( tb_iter_valid( &it ) && c <= 0 )
+  {
+    tb_iter_prev( &it );
+    --r;
+    c = INT64_MAX;
+  }
+  while ( tb_iter_valid( &it ) && r >= begin && ! job_stopped( job, chunk ) )
+  {
+    int64_t len = line_len( tb_iter_line( &it ) );
+    struct tb_run run;
+    tb_iter_run_back( &it, run_max( s, tb ), r - begin + 1, &run );
+    if ( ! run_may_match( s, tb, &run ) )
+    {
+      r -= run.nlines;
+      c = INT64_MAX;
+      continue;
+    }
+    const char* match;
+    if ( rc )
+      match = regex_mem_rev( s, rc, run.p, run.len, c, &len );
+    else
+    {
+      // matches have to start before column c of the last line
+      int64_t n = run.len;
+      if ( c <= len )
+        n -= len - (c - 1 + s->len) < 0 ? 0 : len - (c - 1 + s->len);
+      match = search_mem_rev( s, run.p, n );
+      len = s->len;
+    }
+    if ( match )
+    {
+      const char* bol = match;
+      while ( bol > run.p && bol[-1] != '\n' )
+        --bol;
+      hit->r = r - simd_count( bol, '\n', run.p + run.len - bol );
+      hit->c = match - bol;
+      hit->len = len;
+      return true;
+    }
+    r -= run.nlines;
+    c = INT64_MAX;
+  }
+  return false;
+}
+
+bool search_forward( const struct search* s, const struct textbuf* tb, int64_t r, int64_t c, struct search_hit* hit )
+{
+  struct regex_cache* rc = s->re ? regex_cache_new( s->re ) : 0;
+  bool found = scan_forward( s, rc, tb, r, c, INT64_MAX, 0, 0, hit );
+  regex_cache_free( rc );
+  return found;
+}
+
+bool search_backward( const struct search* s, const struct textbuf* tb, int64_t r, int64_t c, struct search_hit* hit )
+{
+  struct regex_cache* rc = s->re ? regex_cache_new( s->re ) : 0;
+  bool found = scan_backward( s, rc, tb, r, c, 0, 0, 0, hit );
+  regex_cache_free( rc );
+  return found;
+}
+
+void search_replace( struct textbuf* tb, const struct search_hit* hit, const char* rep, int64_t n )
+{
+  struct line* l = tb_line_mut( tb, hit->r );
+  line_erase( tb, l, hit->c, hit->len );
+  line_insert( tb, l, hit->c, rep, n );
+}
+
+static void out_reserve( char** out, int64_t* cap, int64_t n )
+{
+  if ( n <= *cap )
+    return;
+  *cap = n < 2 * *cap ? 2 * *cap : n;
+  *out = realloc( *out, *cap );
+  if ( ! *out ) err( EX_OSERR, NULL );
+}
+
+// replace the matches in line r from column c on, returns their number
+// The new text is put together in out and assigned to the line at once.
+static int64_t replace_line( const struct search* s, struct regex_cache* rc, struct textbuf* tb, int64_t r, int64_t c,
+                             const char* rep, int64_t n, char** out, int64_t* out_cap, struct search_hit* last )
+{
+  struct line* l = tb_line_mut( tb, r );
+  const char* p = line_data( l );
+  int64_t len = line_len( l );
+  int64_t copied = 0, out_len = 0, count = 0;
+  while ( c <= len )
+  {
+    int64_t start, mlen = s->len;
+    if ( rc )
+    {
+      if ( ! regex_first( rc, p, len, c, &start, &mlen ) )
+        break;
+    }
+    else
+    {
+      const char* match = search_mem( s, p + c, len - c );
+      if ( ! match )
+        break;
+      start = match - p;
+    }
+    out_reserve( out, out_cap, out_len + start - copied + n );
+    memcpy( *out + out_len, p + copied, start - copied );
+    out_len += start - copied;
+    memcpy( *out + out_len, rep, n );
+    *last = (struct search_hit) { r, out_len, n };
+    out_len += n;
+    copied = start + mlen;
+    ++count;
+    // an empty match is replaced once, the search goes on behind it
+    c = mlen > 0 ? copied : start + 1;
+  }
+  out_reserve( out, out_cap, out_len + len - copied );
+  memcpy( *out + out_len, p + copied, len - copied );
+  line_assign( tb, l, *out, out_len + len - copied );
+  return count;
+}
+
+// call fn for every line of r .. end-1 with a match, from column c of line r on
+// Each run is scanned once.  fn gets the column of the first match in the
+// line and may rewrite the line: only the record changes, the text of a run
+// of several lines stays where it is in the file image.
+static void scan_lines( const struct search* s, struct regex_cache* rc, const struct textbuf* tb, int64_t r, int64_t c,
+                        int64_t end, atomic_bool* cancel, void (*fn)( void* ctx, int64_t r, int64_t c ), void* ctx )
+{
+  struct tb_iter it;
+  tb_iter_at( tb, r, &it );
+  if ( tb_iter_valid( &it ) && c > line_len( tb_iter_line( &it ) ) )
+  {
+    tb_iter_next( &it );
+    ++r;
+    c = 0;
+  }
+  while ( tb_iter_valid( &it ) && r < end && ! (cancel && atomic_load( cancel )) )
+  {
+    struct tb_run run;
+    tb_iter_run( &it, run_max( s, tb ), end - r, &run );
+    if ( ! run_may_match( s, tb, &run ) )
+    {
+      r += run.nlines;
+      c = 0;
+      continue;
+    }
+    const char* run_end = run.p + run.len;
+    const char* bol = run.p;
+    int64_t row = r;
+    while ( 1 )
+    {
+      int64_t len = s->len;
+      const char* match = rc ? regex_mem( s, rc, bol, run_end - bol, c, &len ) : search_mem( s, bol + c, run_end - bol - c );
+      if ( ! match )
+        break;
+      const char* line = match;
+      while ( line > bol && line[-1] != '\n' )
+        --line;
+      row += simd_count( bol, '\n', line - bol );
+      fn( ctx, row, match - line );
+      if ( row == r + run.nlines - 1 )
+        break;
+      const char* eol = simd_memchr( match, '\n', run_end - match );
+      if ( ! eol )
+        break;
+      bol = eol + 1;
+      ++row;
+      c = 0;
+    }
+    r += run.nlines;
+    c = 0;
+  }
+}
+
+struct replace_ctx
+{
+  const struct search* s;
+  struct regex_cache* rc;
+  struct textbuf* tb;
+  const char* rep;
+  int64_t n;
+  char* out;       //< the new text of a line
+  int64_t out_cap;
+  struct search_hit* last;
+  int64_t count;
+};
+
+static void replace_fn( void* ctx, int64_t r, int64_t c )
+{
+  struct replace_ctx* x = ctx;
+  x->count += replace_line( x->s, x->rc, x->tb, r, c, x->rep, x->n, &x->out, &x->out_cap, x->last );
+}
+
+int64_t search_replace_all( const struct search* s, struct textbuf* tb, int64_t r, int64_t c,
+                            const char* rep, int64_t n, struct search_hit* last )
+{
+  struct replace_ctx x = { s, s->re ? regex_cache_new( s->re ) : 0, tb, rep, n, 0, 0, last, 0 };
+  scan_lines( s, x.rc, tb, r, c, INT64_MAX, 0, replace_fn, &x );
+  free( x.out );
+  regex_cache_free( x.rc );
+  return x.count;
+}
+
+static void search_chunk( struct search_job* job, int64_t k )
+{
+  if ( job_stopped( job, k ) )
+    return;
+  struct search_hit hit;
+  bool found;
+  struct regex_cache* rc = job->s->re ? regex_cache_new( job->s->re ) : 0;
+  if ( job->backward )
+  {
+    int64_t top = job->r - k * job->lines;
+    int64_t begin = top - job->lines + 1 < 0 ? 0 : top - job->lines + 1;
+    found = scan_backward( job->s, rc, job->tb, top, k == 0 ? job->c : INT64_MAX, begin, job, k, &hit );
+  }
+  else
+  {
+    int64_t begin = job->r + k * job->lines;
+    found = scan_forward( job->s, rc, job->tb, begin, k == 0 ? job->c : 0, begin + job->lines, job, k, &hit );
+  }
+  regex_cache_free( rc );
+  if ( ! found )
+    return;
+  job->hits[k] = hit;
+  int_fast64_t best = atomic_load( &job->best );
+  while ( k < best && ! atomic_compare_exchange_weak( &job->best, &best, k ) )
+    ;
+}
+
+static void search_task( void* ctx, int64_t task )
+{
+  search_chunk( ctx, task + 1 );
+}
+
+struct search_job* search_job_start( const struct search* s, const struct textbuf* tb, bool backward, int64_t r, int64_t c )
+{
+  struct search_job* job = calloc( 1, sizeof(struct search_job) );
+  if ( ! job ) err( EX_OSERR, NULL );
+  job->s = s;
+  job->tb = tb;
+  job->backward = backward;
+  job->r = r;
+  job->c = c;
+  int64_t total = 0;
+  if ( r >= 0 && r < tb_size( tb ) )
+    total = backward ? r + 1 : tb_size( tb ) - r;
+  // several chunks per core to balance the load, small ones so that
+  // chunk 0 stays quick and cancelling is fast
+  job->lines = total / (parallel_ncpus() * 8);
+  if ( job->lines < SEARCH_CHUNK_LINES )
+    job->lines = SEARCH_CHUNK_LINES;
+  if ( job->lines > SEARCH_CHUNK_LINES_MAX )
+    job->lines = SEARCH_CHUNK_LINES_MAX;
+  job->nchunks = (total + job->lines - 1) / job->lines;
+  atomic_init( &job->best, job->nchunks );
+  atomic_init( &job->cancel, false );
+  job->hits = malloc( (job->nchunks + 1) * sizeof(struct search_hit) );
+  if ( ! job->hits ) err( EX_OSERR, NULL );
+
+  // most searches end close to the start, do not bother the workers then
+  if ( job->nchunks > 0 )
+    search_chunk( job, 0 );
+  if ( atomic_load( &job->best ) == job->nchunks && job->nchunks > 1 )
+    job->workers = parallel_start( job->nchunks - 1, search_task, job );
+  return job;
+}
+
+bool search_job_done( struct search_job* job )
+{
+  return ! job->workers || parallel_done( job->workers );
+}
+
+bool search_job_finish( struct search_job* job, bool cancel, struct search_hit* hit )
+{
+  if ( cancel )
+    atomic_store( &job->cancel, true );
+  if ( job->workers )
+    parallel_finish( job->workers, cancel );
+  int64_t best = atomic_load( &job->best );
+  bool found = ! cancel && best < job->nchunks;
+  if ( found )
+    *hit = job->hits[best];
+  free( job->hits );
+  free( job );
+  return found;
+}
+
+// A line job uses the same chunks as a search job, but every chunk is
+// searched to its end.  The caller reads the rows of a chunk once it is
+// done, so they come out in order.
+struct lines_chunk
+{
+  int64_t* rows;
+  int64_t n, cap;
+  atomic_bool done;
+};
+
+struct search_lines
+{
+  const struct search* s;
+  const struct textbuf* tb;
+  int64_t lines;   //< per chunk
+  int64_t nchunks;
+  struct lines_chunk* chunks;
+  atomic_bool cancel;
+  int64_t next;    //< chunk the caller reads from
+  int64_t pos;     //< next row in it
+  struct parallel_job* workers;
+};
+
+static void lines_fn( void* ctx, int64_t r, int64_t c )
+{
+  struct lines_chunk* chunk = ctx;
+  if ( chunk->n == chunk->cap )
+  {
+    chunk->cap = chunk->cap ? chunk->cap * 2 : 64;
+    chunk->rows = realloc( chunk->rows, chunk->cap * sizeof(int64_t) );
+    if ( ! chunk->rows ) err( EX_OSERR, NULL );
+  }
+  chunk->rows[chunk->n++] = r;
+}
+
+static void lines_task( void* ctx, int64_t k )
+{
+  struct search_lines* job = ctx;
+  struct regex_cache* rc = job->s->re ? regex_cache_new( job->s->re ) : 0;
+  scan_lines( job->s, rc, job->tb, k * job->lines, 0, (k + 1) * job->lines, &job->cancel, lines_fn, &job->chunks[k] );
+  regex_cache_free( rc );
+  atomic_store( &job->chunks[k].done, true );
+}
+
+struct search_lines* search_lines_start( const struct search* s, const struct textbuf* tb )
+{
+  struct search_lines* job = calloc( 1, sizeof(struct search_lines) );
+  if ( ! job ) err( EX_OSERR, NULL );
+  job->s = s;
+  job->tb = tb;
+  int64_t total = tb_size( tb );
+  job->lines = total / (parallel_ncpus() * 8);
+  if ( job->lines < SEARCH_CHUNK_LINES )
+    job->lines = SEARCH_CHUNK_LINES;
+  if ( job->lines > SEARCH_CHUNK_LINES_MAX )
+    job->lines = SEARCH_CHUNK_LINES_MAX;
+  job->nchunks = (total + job->lines - 1) / job->lines;
+  job->chunks = calloc( job->nchunks + 1, sizeof(struct lines_chunk) );
+  if ( ! job->chunks ) err( EX_OSERR, NULL );
+  for ( int64_t k = 0; k < job->nchunks; ++k )
+    atomic_init( &job->chunks[k].done, false );
+  atomic_init( &job->cancel, false );
+  if ( job->nchunks > 0 )
+    job->workers = parallel_start( job->nchunks, lines_task, job );
+  return job;
+}
+
+int64_t search_lines_next( struct search_lines* job, int64_t* rows, int64_t max )
+{
+  int64_t n = 0;
+  while ( n < max && job->next < job->nchunks && atomic_load( &job->chunks[job->next].done ) )
+  {
+    struct lines_chunk* chunk = &job->chunks[job->next];
+    int64_t k = chunk->n - job->pos < max - n ? chunk->n - job->pos : max - n;
+    memcpy( rows + n, chunk->rows + job->pos, k * sizeof(int64_t) );
+    n += k;
+    job->pos += k;
+    if ( job->pos == chunk->n )
+    {
+      free( chunk->rows );
+      chunk->rows = 0;
+      ++job->next;
+      job->pos = 0;
+    }
+  }
+  return n;
+}
+
+bool search_lines_done( const struct search_lines* job )
+{
+  return job->next == job->nchunks;
+}
+
+void search_lines_finish( struct search_lines* job )
+{
+  atomic_store( &job->cancel, true );
+  if ( job->workers )
+    parallel_finish( job->workers, true );
+  for ( int64_t k = 0; k < job->nchunks; ++k )
+    free( job->chunks[k].rows );
+  free( job->chunks );
+  free( job );
+}
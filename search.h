@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct textbuf;
+struct regex;
+
+// Literal search.
+//
+// A needle is compiled once by search_init().  Matching filters the text
+// for the first and last byte of the needle with simd_find_pair() and only
+// compares the few candidates, so a search that never matches runs at
+// about memory speed.  Unedited lines are scanned as whole runs of the file
+// image instead of line by line, see tb_iter_run().  If the buffer has a
+// trigram index (see trigram.h), runs it rules out are skipped unread.
+//
+// Large buffers are searched by a search job: the lines are split into
+// chunks searched in parallel in the background, while the caller stays
+// responsive and can cancel the job.
+//
+// Case is handled like Emacs' smart case: a needle without upper case
+// letters matches case insensitively.  Folding is ASCII only.
+//
+// A regexp search (see regex.h) uses the same machinery: the longest
+// literal every match has to contain is the needle that filters the text,
+// and only the lines with it are run through the DFA.
+
+// bytes scanned at once when searching runs of lines
+#define SEARCH_RUN_MAX (1 << 20)
+// lines per chunk of a search job
+#define SEARCH_CHUNK_LINES (1 << 14)
+#define SEARCH_CHUNK_LINES_MAX (1 << 18)
+
+struct search
+{
+  char* needle; //< lower case if fold
+  int64_t len;
+  bool fold;    //< ignore case
+  bool single;  //< the needle contains no line ending, runs of lines can be scanned at once
+  char first[2]; //< both cases of the first byte of needle
+  char last[2];  //< both cases of the last byte of needle
+  struct regex* re; //< regexp of a regexp search, the needle is its literal
+};
+
+struct search_hit
+{
+  int64_t r, c; //< start of the match
+  int64_t len;
+};
+
+void search_init( struct search* s, const char* needle, int64_t len );
+// regexp search for pattern, returns the error if pattern is invalid or
+// incomplete, s can only be freed then
+const char* search_init_regex( struct search* s, const char* pattern, int64_t len );
+void search_free( struct search* s );
+
+// first match in the n bytes at p, 0 if none
+const char* search_mem( const struct search* s, const char* p, int64_t n );
+// last match in the n bytes at p, 0 if none
+const char* search_mem_rev( const struct search* s, const char* p, int64_t n );
+// first match starting at column c of line r or later, false if none
+bool search_forward( const struct search* s, const struct textbuf* tb, int64_t r, int64_t c, struct search_hit* hit );
+// last match starting before column c of line r or in an earlier line, false if none
+bool search_backward( const struct search* s, const struct textbuf* tb, int64_t r, int64_t c, struct search_hit* hit );
+
+// replace the match hit by the n bytes at rep
+void search_replace( struct textbuf* tb, const struct search_hit* hit, const char* rep, int64_t n );
+// replace all matches from column c of line r on by the n bytes at rep,
+// returns their number and sets *last to the last replacement if there is one
+// Each line with matches is rebuilt in a single pass and allocation.
+int64_t search_replace_all( const struct search* s, struct textbuf* tb, int64_t r, int64_t c,
+                            const char* rep, int64_t n, struct search_hit* last );
+
+struct search_job;
+
+// start a search like search_forward() or search_backward() on all cores
+// The chunk around the start is searched right away by the calling thread,
+// so near matches cost no threads.  s and tb must not change until
+// search_job_finish().
+struct search_job* search_job_start( const struct search* s, const struct textbuf* tb, bool backward, int64_t r, int64_t c );
+// the result is known
+bool search_job_done( struct search_job* job );
+// wait for the job or cancel it and free it, false if there is no match or it was cancelled
+bool search_job_finish( struct search_job* job, bool cancel, struct search_hit* hit );
+
+struct search_lines;
+
+// list all lines with a match on all cores in the background
+// s and tb must not change until search_lines_finish().
+struct search_lines* search_lines_start( const struct search* s, const struct textbuf* tb );
+// copy up to max of the next matching lines to rows, returns their number
+// The lines come in order, as soon as the chunk they are in is searched.
+int64_t search_lines_next( struct search_lines* job, int64_t* rows, int64_t max );
+// all lines were read
+bool search_lines_done( const struct search_lines* job );
+// stop the job if it still runs and free it
+void search_lines_finish( struct search_lines* job );
@@ -0,0 +1,281 @@
+#include "simd.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+//// scalar
+
+static const char* memchr_scalar( const char* p, char c, int64_t n )
+{
+  return memchr( p, c, n );
+}
+
+static int64_t count_scalar( const char* p, char c, int64_t n )
+{
+  int64_t res = 0;
+  for ( int64_t i = 0; i < n; ++i )
+    res += p[i] == c;
+  return res;
+}
+
+static int64_t index_scalar( const char* p, char c, int64_t n, uint32_t* out )
+{
+  int64_t k = 0;
+  for ( int64_t i = 0; i < n; ++i )
+    if ( p[i] == c )
+      out[k++] = i;
+  return k;
+}
+
+static const char* find_pair_scalar( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist )
+{
+  for ( int64_t i = 0; i + dist < n; ++i )
+    if ( (p[i] == a[0] || p[i] == a[1]) && (p[i+dist] == b[0] || p[i+dist] == b[1]) )
+      return p + i;
+  return 0;
+}
+
+static const char* rfind_pair_scalar( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist )
+{
+  for ( int64_t i = n - dist - 1; i >= 0; --i )
+    if ( (p[i+dist] == b[0] || p[i+dist] == b[1]) && (p[i] == a[0] || p[i] == a[1]) )
+      return p + i;
+  return 0;
+}
+
+#ifdef SIMD_X86
+
+//// sse2
+
+__attribute__((target("sse2")))
+static const char* memchr_sse2( const char* p, char c, int64_t n )
+{
+  __m128i needle = _mm_set1_epi8( c );
+  int64_t i = 0;
+  for ( ; i + 16 <= n; i += 16 )
+  {
+    __m128i v = _mm_loadu_si128( (const __m128i*) (p + i) );
+    unsigned m = _mm_movemask_epi8( _mm_cmpeq_epi8( v, needle ) );
+    if ( m )
+      return p + i + __builtin_ctz( m );
+  }
+  return memchr_scalar( p + i, c, n - i );
+}
+
+__attribute__((target("sse2")))
+static int64_t count_sse2( const char* p, char c, int64_t n )
+{
+  __m128i needle = _mm_set1_epi8( c );
+  int64_t res = 0;
+  int64_t i = 0;
+  for ( ; i + 16 <= n; i += 16 )
+  {
+    __m128i v = _mm_loadu_si128( (const __m128i*) (p + i) );
+    res += __builtin_popcount( _mm_movemask_epi8( _mm_cmpeq_epi8( v, needle ) ) );
+  }
+  return res + count_scalar( p + i, c, n - i );
+}
+
+__attribute__((target("sse2")))
+static int64_t index_sse2( const char* p, char c, int64_t n, uint32_t* out )
+{
+  __m128i needle = _mm_set1_epi8( c );
+  int64_t k = 0;
+  int64_t i = 0;
+  for ( ; i + 16 <= n; i += 16 )
+  {
+    __m128i v = _mm_loadu_si128( (const __m128i*) (p + i) );
+    unsigned m = _mm_movemask_epi8( _mm_cmpeq_epi8( v, needle ) );
+    for ( ; m; m &= m - 1 )
+      out[k++] = i + __builtin_ctz( m );
+  }
+  for ( ; i < n; ++i )
+    if ( p[i] == c )
+      out[k++] = i;
+  return k;
+}
+
+__attribute__((target("sse2")))
+static const char* find_pair_sse2( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist )
+{
+  __m128i a0 = _mm_set1_epi8( a[0] ), a1 = _mm_set1_epi8( a[1] );
+  __m128i b0 = _mm_set1_epi8( b[0] ), b1 = _mm_set1_epi8( b[1] );
+  int64_t i = 0;
+  for ( ; i + dist + 16 <= n; i += 16 )
+  {
+    __m128i va = _mm_loadu_si128( (const __m128i*) (p + i) );
+    __m128i vb = _mm_loadu_si128( (const __m128i*) (p + i + dist) );
+    __m128i ma = _mm_or_si128( _mm_cmpeq_epi8( va, a0 ), _mm_cmpeq_epi8( va, a1 ) );
+    __m128i mb = _mm_or_si128( _mm_cmpeq_epi8( vb, b0 ), _mm_cmpeq_epi8( vb, b1 ) );
+    unsigned m = _mm_movemask_epi8( _mm_and_si128( ma, mb ) );
+    if ( m )
+      return p + i + __builtin_ctz( m );
+  }
+  return find_pair_scalar( p + i, n - i, a, b, dist );
+}
+
+__attribute__((target("sse2")))
+static const char* rfind_pair_sse2( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist )
+{
+  __m128i a0 = _mm_set1_epi8( a[0] ), a1 = _mm_set1_epi8( a[1] );
+  __m128i b0 = _mm_set1_epi8( b[0] ), b1 = _mm_set1_epi8( b[1] );
+  int64_t i = n - dist - 16;
+  for ( ; i >= 0; i -= 16 )
+  {
+    __m128i vb = _mm_loadu_si128( (const __m128i*) (p + i + dist) );
+    __m128i va = _mm_loadu_si128( (const __m128i*) (p + i) );
+    __m128i mb = _mm_or_si128( _mm_cmpeq_epi8( vb, b0 ), _mm_cmpeq_epi8( vb, b1 ) );
+    __m128i ma = _mm_or_si128( _mm_cmpeq_epi8( va, a0 ), _mm_cmpeq_epi8( va, a1 ) );
+    unsigned m = _mm_movemask_epi8( _mm_and_si128( ma, mb ) );
+    if ( m )
+      return p + i + 31 - __builtin_clz( m );
+  }
+  // candidates below i + 16
+  return rfind_pair_scalar( p, i + 16 + dist, a, b, dist );
+}
+
+//// avx2
+
+__attribute__((target("avx2")))
+static const char* memchr_avx2( const char* p, char c, int64_t n )
+{
+  __m256i needle = _mm256_set1_epi8( c );
+  int64_t i = 0;
+  for ( ; i + 32 <= n; i += 32 )
+  {
+    __m256i v = _mm256_loadu_si256( (const __m256i*) (p + i) );
+    unsigned m = _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, needle ) );
+    if ( m )
+      return p + i + __builtin_ctz( m );
+  }
+  return memchr_sse2( p + i, c, n - i );
+}
+
+__attribute__((target("avx2")))
+static int64_t count_avx2( const char* p, char c, int64_t n )
+{
+  __m256i needle = _mm256_set1_epi8( c );
+  int64_t res = 0;
+  int64_t i = 0;
+  for ( ; i + 32 <= n; i += 32 )
+  {
+    __m256i v = _mm256_loadu_si256( (const __m256i*) (p + i) );
+    res += __builtin_popcount( _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, needle ) ) );
+  }
+  return res + count_scalar( p + i, c, n - i );
+}
+
+__attribute__((target("avx2")))
+static int64_t index_avx2( const char* p, char c, int64_t n, uint32_t* out )
+{
+  __m256i needle = _mm256_set1_epi8( c );
+  int64_t k = 0;
+  int64_t i = 0;
+  for ( ; i + 32 <= n; i += 32 )
+  {
+    __m256i v = _mm256_loadu_si256( (const __m256i*) (p + i) );
+    unsigned m = _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, needle ) );
+    for ( ; m; m &= m - 1 )
+      out[k++] = i + __builtin_ctz( m );
+  }
+  for ( ; i < n; ++i )
+    if ( p[i] == c )
+      out[k++] = i;
+  return k;
+}
+
+__attribute__((target("avx2")))
+static const char* find_pair_avx2( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist )
+{
+  __m256i a0 = _mm256_set1_epi8( a[0] ), a1 = _mm256_set1_epi8( a[1] );
+  __m256i b0 = _mm256_set1_epi8( b[0] ), b1 = _mm256_set1_epi8( b[1] );
+  int64_t i = 0;
+  for ( ; i + dist + 32 <= n; i += 32 )
+  {
+    __m256i va = _mm256_loadu_si256( (const __m256i*) (p + i) );
+    __m256i vb = _mm256_loadu_si256( (const __m256i*) (p + i + dist) );
+    __m256i ma = _mm256_or_si256( _mm256_cmpeq_epi8( va, a0 ), _mm256_cmpeq_epi8( va, a1 ) );
+    __m256i mb = _mm256_or_si256( _mm256_cmpeq_epi8( vb, b0 ), _mm256_cmpeq_epi8( vb, b1 ) );
+    unsigned m = _mm256_movemask_epi8( _mm256_and_si256( ma, mb ) );
+    if ( m )
+      return p + i + __builtin_ctz( m );
+  }
+  return find_pair_sse2( p + i, n - i, a, b, dist );
+}
+
+__attribute__((target("avx2")))
+static const char* rfind_pair_avx2( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist )
+{
+  __m256i a0 = _mm256_set1_epi8( a[0] ), a1 = _mm256_set1_epi8( a[1] );
+  __m256i b0 = _mm256_set1_epi8( b[0] ), b1 = _mm256_set1_epi8( b[1] );
+  int64_t i = n - dist - 32;
+  for ( ; i >= 0; i -= 32 )
+  {
+    __m256i vb = _mm256_loadu_si256( (const __m256i*) (p + i + dist) );
+    __m256i va = _mm256_loadu_si256( (const __m256i*) (p + i) );
+    __m256i mb = _mm256_or_si256( _mm256_cmpeq_epi8( vb, b0 ), _mm256_cmpeq_epi8( vb, b1 ) );
+    __m256i ma = _mm256_or_si256( _mm256_cmpeq_epi8( va, a0 ), _mm256_cmpeq_epi8( va, a1 ) );
+    unsigned m = _mm256_movemask_epi8( _mm256_and_si256( ma, mb ) );
+    if ( m )
+      return p + i + 31 - __builtin_clz( m );
+  }
+  return rfind_pair_sse2( p, i + 32 + dist, a, b, dist );
+}
+
+#endif
+
+//// dispatch
+
+static const char* (*memchr_impl)( const char*, char, int64_t ) = memchr_scalar;
+static int64_t (*count_impl)( const char*, char, int64_t ) = count_scalar;
+static int64_t (*index_impl)( const char*, char, int64_t, uint32_t* ) = index_scalar;
+static const char* (*find_pair_impl)( const char*, int64_t, const char*, const char*, int64_t ) = find_pair_scalar;
+static const char* (*rfind_pair_impl)( const char*, int64_t, const char*, const char*, int64_t ) = rfind_pair_scalar;
+static const char* impl_name = "scalar";
+
+void simd_init( void )
+{
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) )
+  {
+    memchr_impl = memchr_avx2;
+    count_impl = count_avx2;
+    index_impl = index_avx2;
+    find_pair_impl = find_pair_avx2;
+    rfind_pair_impl = rfind_pair_avx2;
+    impl_name = "avx2";
+  }
+  else if ( __builtin_cpu_supports( "sse2" ) )
+  {
+    memchr_impl = memchr_sse2;
+    count_impl = count_sse2;
+    index_impl = index_sse2;
+    find_pair_impl = find_pair_sse2;
+    rfind_pair_impl = rfind_pair_sse2;
+    impl_name = "sse2";
+  }
+#endif
+}
+
+const char* simd_name( void ) { return impl_name; }
+
+const char* simd_memchr( const char* p, char c, int64_t n ) { return memchr_impl( p, c, n ); }
+
+int64_t simd_count( const char* p, char c, int64_t n ) { return count_impl( p, c, n ); }
+
+int64_t simd_index( const char* p, char c, int64_t n, uint32_t* out ) { return index_impl( p, c, n, out ); }
+
+const char* simd_find_pair( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist )
+{
+  return find_pair_impl( p, n, a, b, dist );
+}
+
+const char* simd_rfind_pair( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist )
+{
+  return rfind_pair_impl( p, n, a, b, dist );
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// Byte scanning kernels.
+//
+// On x86 the SSE2 or AVX2 variant is picked at runtime by simd_init(),
+// other platforms use portable scalar code.
+
+// select the kernels for this cpu, call once at startup before any thread is started
+void simd_init( void );
+
+// name of the selected kernel set, e.g. "avx2"
+const char* simd_name( void );
+
+// first byte c in the n bytes at p, 0 if none
+const char* simd_memchr( const char* p, char c, int64_t n );
+
+// number of bytes c in the n bytes at p
+int64_t simd_count( const char* p, char c, int64_t n );
+
+// store the offsets of all bytes c in the n bytes at p relative to p into out
+// out must have room for simd_count() entries, n must be < 4 GiB.
+// Returns the number of offsets stored.
+int64_t simd_index( const char* p, char c, int64_t n, uint32_t* out );
+
+// first position i with p[i] one of a[0], a[1] and p[i+dist] one of b[0],
+// b[1], i + dist < n, 0 if none
+// Filters match candidates of a needle by its first and last byte, give
+// both cases of a letter for case insensitive search.
+const char* simd_find_pair( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist );
+// like simd_find_pair() but the last such position, scanning from the end
+const char* simd_rfind_pair( const char* p, int64_t n, const char a[2], const char b[2], int64_t dist );
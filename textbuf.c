@@ -0,0 +1,1225 @@
+#define _DEFAULT_SOURCE //< st_mtim
+
+#include "textbuf.h"
+#include "simd.h"
+#include "parallel.h"
+#include "trigram.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// rests of the file image smaller than this are indexed by the calling thread
+#define TB_PARALLEL_MIN (8 << 20)
+// bytes scanned by the loader per round, offsets inside a round are 32 bit
+#define TB_LOAD_ROUND_MIN (4 << 20)
+#define TB_LOAD_ROUND_MAX (64 << 20)
+// newline offsets per block published by the loader
+#define TB_LOAD_BLOCK (1 << 16)
+// lines moved from the loader into the tree by one tb_poll()
+#define TB_POLL_BUDGET (1 << 20)
+// smaller images are searched faster than a trigram index is built
+#define TB_TRIGRAM_MIN (64 << 20)
+
+// nodes with less entries than this are merged with a neighbour if possible
+#define TB_LEAF_MIN (TB_LEAF_MAX / 4)
+#define TB_NODE_MIN (TB_NODE_MAX / 4)
+
+struct tb_node
+{
+  bool leaf;
+  int n; //< number of lines in a leaf, number of children otherwise
+  union
+  {
+    struct
+    {
+      struct tb_node* child[TB_NODE_MAX];
+      int64_t cnt[TB_NODE_MAX]; //< number of lines below child[i]
+    } in;
+    struct
+    {
+      struct line line[TB_LEAF_MAX];
+      struct tb_node* prev;
+      struct tb_node* next;
+      bool contig; //< the lines are views following each other in the image, see tb_iter_run()
+    } lf;
+  } u;
+};
+
+//// lines
+
+static int64_t line_cap( const struct line* l )
+{
+  return line_is_inline( l ) ? LINE_INLINE : l->u.ext.cap;
+}
+
+static char* line_wdata( struct line* l )
+{
+  assert( ! line_is_view( l ) );
+  return line_is_inline( l ) ? l->u.in : l->u.ext.data;
+}
+
+void line_reserve( struct textbuf* tb, struct line* l, int64_t cap )
+{
+  if ( cap <= line_cap( l ) )
+    return;
+  int64_t len = line_len( l );
+  if ( cap <= LINE_INLINE )
+  {
+    // short view, copy on first write into the record
+    memmove( l->u.in, l->u.ext.data, len );
+    l->ilen = len;
+    return;
+  }
+  if ( cap > LINE_MAX_LEN )
+    errx( EX_SOFTWARE, "line longer than %u bytes", LINE_MAX_LEN );
+
+  int64_t ncap = line_cap( l ) < 32 ? 32 : line_cap( l );
+  while ( ncap < cap )
+    ncap *= 2;
+  ncap = arena_round( ncap < LINE_MAX_LEN ? ncap : LINE_MAX_LEN );
+  char* data = arena_alloc( &tb->mem, ncap );
+  if ( len > 0 )
+    memcpy( data, line_data( l ), len );
+  if ( ! line_is_inline( l ) && ! line_is_view( l ) )
+    arena_release( &tb->mem, l->u.ext.data, l->u.ext.cap );
+  l->u.ext.data = data;
+  l->u.ext.len = len;
+  l->u.ext.cap = ncap;
+  l->ilen = LINE_EXT;
+}
+
+void line_insert( struct textbuf* tb, struct line* l, int64_t pos, const char* s, int64_t n )
+{
+  int64_t len = line_len( l );
+  assert( pos >= 0 && pos <= len );
+  if ( n == 0 )
+    return;
+  line_reserve( tb, l, len + n );
+  char* data = line_wdata( l );
+  memmove( data + pos + n, data + pos, len - pos );
+  memcpy( data + pos, s, n );
+  line_truncate( l, len + n );
+}
+
+void line_erase( struct textbuf* tb, struct line* l, int64_t pos, int64_t n )
+{
+  int64_t len = line_len( l );
+  assert( pos >= 0 && n >= 0 && pos + n <= len );
+  if ( n == 0 )
+    return;
+  line_reserve( tb, l, len );
+  char* data = line_wdata( l );
+  memmove( data + pos, data + pos + n, len - pos - n );
+  line_truncate( l, len - n );
+}
+
+void line_assign( struct textbuf* tb, struct line* l, const char* s, int64_t n )
+{
+  if ( n > LINE_MAX_LEN )
+    errx( EX_SOFTWARE, "line longer than %u bytes", LINE_MAX_LEN );
+  if ( n > line_cap( l ) && n > LINE_INLINE )
+  {
+    char* data = arena_alloc( &tb->mem, n );
+    if ( ! line_is_inline( l ) && ! line_is_view( l ) )
+      arena_release( &tb->mem, l->u.ext.data, l->u.ext.cap );
+    l->u.ext.data = data;
+    l->u.ext.cap = arena_round( n );
+    l->ilen = LINE_EXT;
+  }
+  else if ( n <= LINE_INLINE && ! line_is_inline( l ) )
+  {
+    // short enough for the record, give back the old storage
+    if ( ! line_is_view( l ) )
+      arena_release( &tb->mem, l->u.ext.data, l->u.ext.cap );
+    l->ilen = 0;
+  }
+  memcpy( line_wdata( l ), s, n );
+  line_truncate( l, n );
+}
+
+void line_free( struct textbuf* tb, struct line* l )
+{
+  if ( ! line_is_inline( l ) && ! line_is_view( l ) )
+    arena_release( &tb->mem, l->u.ext.data, l->u.ext.cap );
+  memset( l, 0, sizeof(*l) );
+}
+
+//// tree nodes
+
+static struct tb_node* node_new( struct textbuf* tb, bool leaf )
+{
+  struct tb_node* nd = arena_pool_alloc( &tb->mem, &tb->nodes );
+  nd->leaf = leaf;
+  nd->n = 0;
+  if ( leaf )
+  {
+    nd->u.lf.prev = nd->u.lf.next = 0;
+    nd->u.lf.contig = false;
+  }
+  return nd;
+}
+
+static void node_free( struct textbuf* tb, struct tb_node* nd )
+{
+  arena_pool_release( &tb->nodes, nd );
+}
+
+static int64_t node_total( const struct tb_node* nd )
+{
+  if ( nd->leaf )
+    return nd->n;
+  int64_t res = 0;
+  for ( int i = 0; i < nd->n; ++i )
+    res += nd->u.in.cnt[i];
+  return res;
+}
+
+void tb_init( struct textbuf* tb )
+{
+  arena_init( &tb->mem );
+  arena_pool_init( &tb->nodes, sizeof(struct tb_node) );
+  tb->root = node_new( tb, true );
+  tb->size = 0;
+  tb->img = 0;
+  tb->img_len = tb->img_pos = 0;
+  tb->img_mapped = tb->img_private = false;
+  tb->complete = true;
+  tb->loader = 0;
+  tb->trigrams = 0;
+}
+
+static void loader_free( struct textbuf* tb );
+
+void tb_free( struct textbuf* tb )
+{
+  if ( tb->loader )
+    loader_free( tb );
+  trigram_free( tb->trigrams );
+  tb->trigrams = 0;
+  // lines and nodes all live in the arena, no need to walk the tree
+  arena_free_all( &tb->mem );
+  arena_pool_init( &tb->nodes, sizeof(struct tb_node) );
+  tb->root = 0;
+  tb->size = 0;
+  if ( tb->img_mapped )
+    munmap( (void*) tb->img, tb->img_len );
+  else
+    free( (void*) tb->img );
+  tb->img = 0;
+  tb->img_len = tb->img_pos = 0;
+  tb->img_mapped = tb->img_private = false;
+  tb->complete = true;
+}
+
+// descend to the leaf holding line *r, *r becomes the index inside the leaf
+static struct tb_node* find_leaf( const struct textbuf* tb, int64_t* r )
+{
+  struct tb_node* nd = tb->root;
+  while ( ! nd->leaf )
+  {
+    int i = 0;
+    while ( i + 1 < nd->n && *r >= nd->u.in.cnt[i] )
+    {
+      *r -= nd->u.in.cnt[i];
+      ++i;
+    }
+    nd = nd->u.in.child[i];
+  }
+  return nd;
+}
+
+// b directly follows a in the image
+static bool views_adjacent( const struct line* a, const struct line* b )
+{
+  return line_is_view( a ) && line_is_view( b ) && a->u.ext.data + a->u.ext.len + a->eol == b->u.ext.data;
+}
+
+// contig flag of a leaf holding n lines l
+static bool lines_contig( const struct line* l, int n )
+{
+  if ( n == 0 || ! line_is_view( &l[0] ) )
+    return false;
+  for ( int i = 1; i < n; ++i )
+    if ( ! views_adjacent( &l[i-1], &l[i] ) )
+      return false;
+  return true;
+}
+
+const struct line* tb_line( const struct textbuf* tb, int64_t r )
+{
+  assert( r >= 0 && r < tb->size );
+  struct tb_node* lf = find_leaf( tb, &r );
+  return &lf->u.lf.line[r];
+}
+
+struct line* tb_line_mut( struct textbuf* tb, int64_t r )
+{
+  assert( r >= 0 && r < tb->size );
+  struct tb_node* lf = find_leaf( tb, &r );
+  lf->u.lf.contig = false;
+  return &lf->u.lf.line[r];
+}
+
+//// insertion
+
+// move the upper half of nd into a new right sibling
+static struct tb_node* node_split( struct textbuf* tb, struct tb_node* nd )
+{
+  struct tb_node* right = node_new( tb, nd->leaf );
+  int keep = nd->n / 2;
+  right->n = nd->n - keep;
+  if ( nd->leaf )
+  {
+    memcpy( right->u.lf.line, nd->u.lf.line + keep, right->n * sizeof(struct line) );
+    right->u.lf.contig = nd->u.lf.contig;
+    right->u.lf.prev = nd;
+    right->u.lf.next = nd->u.lf.next;
+    if ( nd->u.lf.next )
+      nd->u.lf.next->u.lf.prev = right;
+    nd->u.lf.next = right;
+  }
+  else
+  {
+    memcpy( right->u.in.child, nd->u.in.child + keep, right->n * sizeof(struct tb_node*) );
+    memcpy( right->u.in.cnt, nd->u.in.cnt + keep, right->n * sizeof(int64_t) );
+  }
+  nd->n = keep;
+  return right;
+}
+
+static void inner_insert_child( struct tb_node* nd, int pos, struct tb_node* child, int64_t cnt )
+{
+  assert( nd->n < TB_NODE_MAX );
+  memmove( nd->u.in.child + pos + 1, nd->u.in.child + pos, (nd->n - pos) * sizeof(struct tb_node*) );
+  memmove( nd->u.in.cnt + pos + 1, nd->u.in.cnt + pos, (nd->n - pos) * sizeof(int64_t) );
+  nd->u.in.child[pos] = child;
+  nd->u.in.cnt[pos] = cnt;
+  ++nd->n;
+}
+
+// insert s as line r below nd, returns the new right sibling if nd was split
+static struct tb_node* node_insert( struct textbuf* tb, struct tb_node* nd, int64_t r, const struct line* l )
+{
+  if ( nd->leaf )
+  {
+    struct tb_node* right = 0;
+    if ( nd->n == TB_LEAF_MAX )
+    {
+      right = node_split( tb, nd );
+      if ( r > nd->n )
+      {
+        r -= nd->n;
+        nd = right;
+      }
+    }
+    memmove( nd->u.lf.line + r + 1, nd->u.lf.line + r, (nd->n - r) * sizeof(struct line) );
+    nd->u.lf.line[r] = *l;
+    ++nd->n;
+    nd->u.lf.contig = false;
+    return right;
+  }
+
+  int i = 0;
+  while ( i + 1 < nd->n && r > nd->u.in.cnt[i] )
+  {
+    r -= nd->u.in.cnt[i];
+    ++i;
+  }
+  struct tb_node* child_right = node_insert( tb, nd->u.in.child[i], r, l );
+  if ( ! child_right )
+  {
+    ++nd->u.in.cnt[i];
+    return 0;
+  }
+
+  nd->u.in.cnt[i] = node_total( nd->u.in.child[i] );
+  int64_t right_cnt = node_total( child_right );
+  struct tb_node* right = 0;
+  struct tb_node* target = nd;
+  int pos = i + 1;
+  if ( nd->n == TB_NODE_MAX )
+  {
+    right = node_split( tb, nd );
+    if ( pos > nd->n )
+    {
+      pos -= nd->n;
+      target = right;
+    }
+  }
+  inner_insert_child( target, pos, child_right, right_cnt );
+  return right;
+}
+
+void tb_insert_line( struct textbuf* tb, int64_t r, const struct line* l )
+{
+  assert( r >= 0 && r <= tb->size );
+  struct tb_node* right = node_insert( tb, tb->root, r, l );
+  if ( right )
+  {
+    struct tb_node* root = node_new( tb, false );
+    inner_insert_child( root, 0, tb->root, node_total( tb->root ) );
+    inner_insert_child( root, 1, right, node_total( right ) );
+    tb->root = root;
+  }
+  ++tb->size;
+}
+
+// put the lines r.. of the leaf behind the n lines at l, filling the leaf
+// and then new packed leaves linked behind it, which are stored at sib
+// Returns the number of new leaves.
+static int64_t leaf_insert_lines( struct textbuf* tb, struct tb_node* lf, int r, const struct line* l, int64_t n, struct tb_node** sib )
+{
+  struct line tail[TB_LEAF_MAX];
+  int tail_n = lf->n - r;
+  memcpy( tail, lf->u.lf.line + r, tail_n * sizeof(struct line) );
+  lf->n = r;
+  const struct line* src[2] = { l, tail };
+  int64_t src_n[2] = { n, tail_n };
+  int64_t k = 0;
+  struct tb_node* cur = lf;
+  for ( int s = 0; s < 2; ++s )
+  {
+    while ( src_n[s] > 0 )
+    {
+      if ( cur->n == TB_LEAF_MAX )
+      {
+        cur->u.lf.contig = lines_contig( cur->u.lf.line, cur->n );
+        struct tb_node* leaf = node_new( tb, true );
+        leaf->u.lf.prev = cur;
+        leaf->u.lf.next = cur->u.lf.next;
+        if ( cur->u.lf.next )
+          cur->u.lf.next->u.lf.prev = leaf;
+        cur->u.lf.next = leaf;
+        sib[k++] = cur = leaf;
+      }
+      int64_t m = TB_LEAF_MAX - cur->n < src_n[s] ? TB_LEAF_MAX - cur->n : src_n[s];
+      memcpy( cur->u.lf.line + cur->n, src[s], m * sizeof(struct line) );
+      cur->n += m;
+      src[s] += m;
+      src_n[s] -= m;
+    }
+  }
+  cur->u.lf.contig = lines_contig( cur->u.lf.line, cur->n );
+  return k;
+}
+
+// insert the k nodes at sib as children pos.. of nd
+// If they do not fit, the children are spread evenly over nd and new right
+// siblings of it, which are stored at sib.  Returns the number of those.
+static int64_t inner_insert_children( struct textbuf* tb, struct tb_node* nd, int pos, struct tb_node** sib, int64_t k )
+{
+  if ( nd->n + k <= TB_NODE_MAX )
+  {
+    memmove( nd->u.in.child + pos + k, nd->u.in.child + pos, (nd->n - pos) * sizeof(struct tb_node*) );
+    memmove( nd->u.in.cnt + pos + k, nd->u.in.cnt + pos, (nd->n - pos) * sizeof(int64_t) );
+    for ( int i = 0; i < k; ++i )
+    {
+      nd->u.in.child[pos+i] = sib[i];
+      nd->u.in.cnt[pos+i] = node_total( sib[i] );
+    }
+    nd->n += k;
+    return 0;
+  }
+
+  int64_t total = nd->n + k;
+  struct tb_node** child = malloc( total * sizeof(struct tb_node*) );
+  int64_t* cnt = malloc( total * sizeof(int64_t) );
+  if ( ! child || ! cnt ) err( EX_OSERR, NULL );
+  memcpy( child, nd->u.in.child, pos * sizeof(struct tb_node*) );
+  memcpy( cnt, nd->u.in.cnt, pos * sizeof(int64_t) );
+  for ( int64_t i = 0; i < k; ++i )
+  {
+    child[pos+i] = sib[i];
+    cnt[pos+i] = node_total( sib[i] );
+  }
+  memcpy( child + pos + k, nd->u.in.child + pos, (nd->n - pos) * sizeof(struct tb_node*) );
+  memcpy( cnt + pos + k, nd->u.in.cnt + pos, (nd->n - pos) * sizeof(int64_t) );
+
+  int64_t parts = (total + TB_NODE_MAX - 1) / TB_NODE_MAX;
+  int64_t from = 0;
+  for ( int64_t j = 0; j < parts; ++j )
+  {
+    struct tb_node* part = j == 0 ? nd : ( sib[j-1] = node_new( tb, false ) );
+    part->n = total / parts + ( j < total % parts );
+    memcpy( part->u.in.child, child + from, part->n * sizeof(struct tb_node*) );
+    memcpy( part->u.in.cnt, cnt + from, part->n * sizeof(int64_t) );
+    from += part->n;
+  }
+  free( child );
+  free( cnt );
+  return parts - 1;
+}
+
+// insert the n lines at l as line r below nd, r inside nd
+// New right siblings nd was split into are stored at sib, returns their number.
+static int64_t node_insert_lines( struct textbuf* tb, struct tb_node* nd, int64_t r, const struct line* l, int64_t n, struct tb_node** sib )
+{
+  if ( nd->leaf )
+    return leaf_insert_lines( tb, nd, r, l, n, sib );
+
+  int i = 0;
+  while ( i + 1 < nd->n && r >= nd->u.in.cnt[i] )
+  {
+    r -= nd->u.in.cnt[i];
+    ++i;
+  }
+  int64_t k = node_insert_lines( tb, nd->u.in.child[i], r, l, n, sib );
+  if ( k == 0 )
+  {
+    nd->u.in.cnt[i] += n;
+    return 0;
+  }
+  nd->u.in.cnt[i] = node_total( nd->u.in.child[i] );
+  return inner_insert_children( tb, nd, i + 1, sib, k );
+}
+
+void tb_insert_lines( struct textbuf* tb, int64_t r, const struct line* l, int64_t n )
+{
+  assert( r >= 0 && r <= tb->size );
+  if ( r == tb->size )
+  {
+    tb_append_lines( tb, l, n );
+    return;
+  }
+  if ( n == 0 )
+    return;
+  // enough for the leaves, every level above has less new nodes
+  struct tb_node** sib = malloc( ( n / TB_LEAF_MAX + 2 ) * sizeof(struct tb_node*) );
+  if ( ! sib ) err( EX_OSERR, NULL );
+  int64_t k = node_insert_lines( tb, tb->root, r, l, n, sib );
+  while ( k > 0 )
+  {
+    // the root was split, grow the tree at the top
+    struct tb_node* root = node_new( tb, false );
+    inner_insert_child( root, 0, tb->root, node_total( tb->root ) );
+    tb->root = root;
+    k = inner_insert_children( tb, root, 1, sib, k );
+  }
+  free( sib );
+  tb->size += n;
+}
+
+//// removal
+
+static void inner_remove_child( struct tb_node* nd, int pos )
+{
+  memmove( nd->u.in.child + pos, nd->u.in.child + pos + 1, (nd->n - pos - 1) * sizeof(struct tb_node*) );
+  memmove( nd->u.in.cnt + pos, nd->u.in.cnt + pos + 1, (nd->n - pos - 1) * sizeof(int64_t) );
+  --nd->n;
+}
+
+// append all entries of child[pos+1] to child[pos] and drop child[pos+1]
+static void inner_merge_children( struct textbuf* tb, struct tb_node* nd, int pos )
+{
+  struct tb_node* left = nd->u.in.child[pos];
+  struct tb_node* right = nd->u.in.child[pos+1];
+  if ( left->leaf )
+  {
+    left->u.lf.contig = left->u.lf.contig && right->u.lf.contig
+      && views_adjacent( &left->u.lf.line[left->n-1], &right->u.lf.line[0] );
+    memcpy( left->u.lf.line + left->n, right->u.lf.line, right->n * sizeof(struct line) );
+    left->u.lf.next = right->u.lf.next;
+    if ( right->u.lf.next )
+      right->u.lf.next->u.lf.prev = left;
+  }
+  else
+  {
+    memcpy( left->u.in.child + left->n, right->u.in.child, right->n * sizeof(struct tb_node*) );
+    memcpy( left->u.in.cnt + left->n, right->u.in.cnt, right->n * sizeof(int64_t) );
+  }
+  left->n += right->n;
+  nd->u.in.cnt[pos] += nd->u.in.cnt[pos+1];
+  node_free( tb, right );
+  inner_remove_child( nd, pos + 1 );
+}
+
+// child[pos] of nd lost entries: drop it if empty or merge it with a neighbour if small
+static void inner_fix_child( struct textbuf* tb, struct tb_node* nd, int pos )
+{
+  struct tb_node* child = nd->u.in.child[pos];
+  if ( child->n == 0 )
+  {
+    if ( child->leaf )
+    {
+      if ( child->u.lf.prev )
+        child->u.lf.prev->u.lf.next = child->u.lf.next;
+      if ( child->u.lf.next )
+        child->u.lf.next->u.lf.prev = child->u.lf.prev;
+    }
+    node_free( tb, child );
+    inner_remove_child( nd, pos );
+    return;
+  }
+
+  int min = child->leaf ? TB_LEAF_MIN : TB_NODE_MIN;
+  int max = child->leaf ? TB_LEAF_MAX : TB_NODE_MAX;
+  if ( child->n >= min )
+    return;
+  if ( pos + 1 < nd->n && child->n + nd->u.in.child[pos+1]->n <= max )
+    inner_merge_children( tb, nd, pos );
+  else if ( pos > 0 && child->n + nd->u.in.child[pos-1]->n <= max )
+    inner_merge_children( tb, nd, pos - 1 );
+}
+
+// free nd with everything below it, its leaves are unlinked from their neighbours
+static void node_free_tree( struct textbuf* tb, struct tb_node* nd )
+{
+  if ( nd->leaf )
+  {
+    for ( int i = 0; i < nd->n; ++i )
+      line_free( tb, &nd->u.lf.line[i] );
+    if ( nd->u.lf.prev )
+      nd->u.lf.prev->u.lf.next = nd->u.lf.next;
+    if ( nd->u.lf.next )
+      nd->u.lf.next->u.lf.prev = nd->u.lf.prev;
+  }
+  else
+    for ( int i = 0; i < nd->n; ++i )
+      node_free_tree( tb, nd->u.in.child[i] );
+  node_free( tb, nd );
+}
+
+// remove the n lines starting at line r below nd
+// Children inside the range are dropped whole, only the two at its ends are
+// descended into and fixed afterwards.
+static void node_remove( struct textbuf* tb, struct tb_node* nd, int64_t r, int64_t n )
+{
+  if ( nd->leaf )
+  {
+    for ( int64_t i = r; i < r + n; ++i )
+      line_free( tb, &nd->u.lf.line[i] );
+    memmove( nd->u.lf.line + r, nd->u.lf.line + r + n, (nd->n - r - n) * sizeof(struct line) );
+    nd->n -= n;
+    // dropping lines in the middle leaves a gap in the image
+    if ( r > 0 && r < nd->n )
+      nd->u.lf.contig = false;
+    return;
+  }
+
+  int i = 0;
+  while ( i + 1 < nd->n && r >= nd->u.in.cnt[i] )
+  {
+    r -= nd->u.in.cnt[i];
+    ++i;
+  }
+  int end = i; //< behind the last child touched
+  int keep = i; //< behind the last child kept so far
+  for ( ; n > 0; ++end, r = 0 )
+  {
+    int64_t k = nd->u.in.cnt[end] - r < n ? nd->u.in.cnt[end] - r : n;
+    n -= k;
+    if ( k == nd->u.in.cnt[end] )
+    {
+      node_free_tree( tb, nd->u.in.child[end] );
+      continue;
+    }
+    node_remove( tb, nd->u.in.child[end], r, k );
+    nd->u.in.cnt[keep] = nd->u.in.cnt[end] - k;
+    nd->u.in.child[keep++] = nd->u.in.child[end];
+  }
+  memmove( nd->u.in.child + keep, nd->u.in.child + end, (nd->n - end) * sizeof(struct tb_node*) );
+  memmove( nd->u.in.cnt + keep, nd->u.in.cnt + end, (nd->n - end) * sizeof(int64_t) );
+  nd->n -= end - keep;
+  // at most the first and the last child are left, fix the right one first
+  // so merging it does not move the left one
+  for ( int j = keep - 1; j >= i; --j )
+    inner_fix_child( tb, nd, j );
+}
+
+void tb_remove_lines( struct textbuf* tb, int64_t r, int64_t n )
+{
+  assert( r >= 0 && n >= 0 && r + n <= tb->size );
+  if ( n == 0 )
+    return;
+  node_remove( tb, tb->root, r, n );
+  tb->size -= n;
+  // shrink the tree from the top
+  while ( ! tb->root->leaf && tb->root->n <= 1 )
+  {
+    struct tb_node* old = tb->root;
+    tb->root = old->n == 1 ? old->u.in.child[0] : node_new( tb, true );
+    node_free( tb, old );
+  }
+}
+
+//// appending
+
+static struct tb_node* last_leaf( const struct textbuf* tb )
+{
+  struct tb_node* nd = tb->root;
+  while ( ! nd->leaf )
+    nd = nd->u.in.child[nd->n-1];
+  return nd;
+}
+
+// add cnt to the line counts on the path to the last leaf
+static void add_to_right_edge( struct textbuf* tb, int64_t cnt )
+{
+  for ( struct tb_node* nd = tb->root; ! nd->leaf; nd = nd->u.in.child[nd->n-1] )
+    nd->u.in.cnt[nd->n-1] += cnt;
+}
+
+// attach leaf as last leaf below nd, returns a new right sibling of nd if nd is full
+static struct tb_node* node_append_leaf( struct textbuf* tb, struct tb_node* nd, struct tb_node* leaf )
+{
+  struct tb_node* child = leaf;
+  if ( ! nd->u.in.child[0]->leaf )
+  {
+    child = node_append_leaf( tb, nd->u.in.child[nd->n-1], leaf );
+    if ( ! child )
+    {
+      nd->u.in.cnt[nd->n-1] += leaf->n;
+      return 0;
+    }
+  }
+  struct tb_node* right = 0;
+  if ( nd->n == TB_NODE_MAX )
+    nd = right = node_new( tb, false );
+  inner_insert_child( nd, nd->n, child, node_total( child ) );
+  return right;
+}
+
+void tb_append_lines( struct textbuf* tb, const struct line* l, int64_t n )
+{
+  while ( n > 0 )
+  {
+    struct tb_node* last = last_leaf( tb );
+    int64_t m = TB_LEAF_MAX - last->n;
+    if ( m > n )
+      m = n;
+    if ( m > 0 )
+    {
+      last->u.lf.contig = last->n == 0 ? lines_contig( l, m )
+        : last->u.lf.contig && views_adjacent( &last->u.lf.line[last->n-1], l ) && lines_contig( l, m );
+      memcpy( last->u.lf.line + last->n, l, m * sizeof(struct line) );
+      last->n += m;
+      add_to_right_edge( tb, m );
+    }
+    else
+    {
+      // start a new packed leaf, appending never splits leaves
+      struct tb_node* leaf = node_new( tb, true );
+      m = n < TB_LEAF_MAX ? n : TB_LEAF_MAX;
+      memcpy( leaf->u.lf.line, l, m * sizeof(struct line) );
+      leaf->n = m;
+      leaf->u.lf.contig = lines_contig( l, m );
+      leaf->u.lf.prev = last;
+      last->u.lf.next = leaf;
+      struct tb_node* right = tb->root->leaf ? leaf : node_append_leaf( tb, tb->root, leaf );
+      if ( right )
+      {
+        struct tb_node* root = node_new( tb, false );
+        inner_insert_child( root, 0, tb->root, node_total( tb->root ) );
+        inner_insert_child( root, 1, right, node_total( right ) );
+        tb->root = root;
+      }
+    }
+    tb->size += m;
+    l += m;
+    n -= m;
+  }
+}
+
+//// loading
+
+// Files too large to be indexed right away are indexed by a loader thread.
+// It scans the image in rounds; every round is split into chunks whose
+// newlines are found in parallel.  The offsets are published in blocks and
+// the main thread pulls them into the tree with tb_poll(), so the tree
+// itself is only ever touched by the main thread.
+
+struct tb_loader
+{
+  const char* img;
+  int64_t img_len;
+  int64_t start; //< image offset the loader started at
+
+  int64_t** blocks; //< absolute newline offsets, TB_LOAD_BLOCK per block
+  atomic_int_fast64_t published; //< number of offsets in blocks
+  atomic_int_fast64_t scanned;   //< bytes scanned
+  atomic_bool done;
+  atomic_bool cancel;
+  pthread_mutex_t mtx;
+  pthread_cond_t cond; //< signaled when offsets are published
+
+  bool has_thread;
+  pthread_t thread;
+  int64_t pulled; //< offsets moved into the tree, main thread only
+};
+
+static struct tb_loader* loader_new( struct textbuf* tb )
+{
+  struct tb_loader* ld = calloc( 1, sizeof(struct tb_loader) );
+  if ( ! ld ) err( EX_OSERR, NULL );
+  ld->img = tb->img;
+  ld->img_len = tb->img_len;
+  ld->start = tb->img_pos;
+  // there cannot be more newlines than bytes
+  ld->blocks = calloc( (ld->img_len - ld->start) / TB_LOAD_BLOCK + 2, sizeof(int64_t*) );
+  if ( ! ld->blocks ) err( EX_OSERR, NULL );
+  atomic_init( &ld->published, 0 );
+  atomic_init( &ld->scanned, ld->start );
+  atomic_init( &ld->done, false );
+  atomic_init( &ld->cancel, false );
+  pthread_mutex_init( &ld->mtx, 0 );
+  pthread_cond_init( &ld->cond, 0 );
+  return ld;
+}
+
+static void loader_free( struct textbuf* tb )
+{
+  struct tb_loader* ld = tb->loader;
+  atomic_store( &ld->cancel, true );
+  if ( ld->has_thread && pthread_join( ld->thread, 0 ) != 0 )
+    err( EX_OSERR, NULL );
+  for ( int64_t b = 0; b * TB_LOAD_BLOCK < atomic_load( &ld->published ); ++b )
+    free( ld->blocks[b] );
+  free( ld->blocks );
+  pthread_mutex_destroy( &ld->mtx );
+  pthread_cond_destroy( &ld->cond );
+  free( ld );
+  tb->loader = 0;
+}
+
+struct index_chunk
+{
+  const char* p;
+  int64_t len;
+  uint32_t* nl; //< offsets of the newlines relative to p
+  int64_t nnl;
+};
+
+static void index_chunk( void* ctx, int64_t task )
+{
+  struct index_chunk* c = (struct index_chunk*) ctx + task;
+  c->nnl = simd_count( c->p, '\n', c->len );
+  c->nl = malloc( (c->nnl + 1) * sizeof(uint32_t) );
+  if ( ! c->nl ) err( EX_OSERR, NULL );
+  simd_index( c->p, '\n', c->len, c->nl );
+}
+
+static void* loader_main( void* arg )
+{
+  struct tb_loader* ld = arg;
+  int64_t pos = ld->start;
+  int64_t count = 0;
+  // small first round for early progress, larger ones later
+  int64_t round = TB_LOAD_ROUND_MIN;
+  while ( pos < ld->img_len && ! atomic_load( &ld->cancel ) )
+  {
+    int64_t len = ld->img_len - pos < round ? ld->img_len - pos : round;
+    int64_t nchunks = parallel_ncpus() * 2;
+    int64_t chunk_len = (len + nchunks - 1) / nchunks;
+    nchunks = (len + chunk_len - 1) / chunk_len;
+    struct index_chunk chunks[nchunks];
+    for ( int64_t i = 0; i < nchunks; ++i )
+    {
+      chunks[i].p = ld->img + pos + i * chunk_len;
+      chunks[i].len = i + 1 < nchunks ? chunk_len : len - i * chunk_len;
+    }
+    parallel_for( nchunks, index_chunk, chunks );
+
+    // stitch the chunks
+    for ( int64_t i = 0; i < nchunks; ++i )
+    {
+      int64_t base = chunks[i].p - ld->img;
+      for ( int64_t j = 0; j < chunks[i].nnl; ++j, ++count )
+      {
+        int64_t** block = &ld->blocks[count / TB_LOAD_BLOCK];
+        if ( ! *block && ! (*block = malloc( TB_LOAD_BLOCK * sizeof(int64_t) )) )
+          err( EX_OSERR, NULL );
+        (*block)[count % TB_LOAD_BLOCK] = base + chunks[i].nl[j];
+      }
+      free( chunks[i].nl );
+    }
+    pos += len;
+
+    pthread_mutex_lock( &ld->mtx );
+    atomic_store( &ld->published, count );
+    atomic_store( &ld->scanned, pos );
+    pthread_cond_broadcast( &ld->cond );
+    pthread_mutex_unlock( &ld->mtx );
+    if ( round < TB_LOAD_ROUND_MAX )
+      round *= 2;
+  }
+  pthread_mutex_lock( &ld->mtx );
+  atomic_store( &ld->done, true );
+  pthread_cond_broadcast( &ld->cond );
+  pthread_mutex_unlock( &ld->mtx );
+  return 0;
+}
+
+// read the file if it cannot be mapped, e.g. a pipe or a special file
+static char* read_all( int fd, int64_t* len )
+{
+  int64_t cap = 1 << 16;
+  char* data = malloc( cap );
+  if ( ! data ) err( EX_OSERR, NULL );
+  *len = 0;
+  while ( 1 )
+  {
+    if ( *len == cap )
+    {
+      cap *= 2;
+      data = realloc( data, cap );
+      if ( ! data ) err( EX_OSERR, NULL );
+    }
+    ssize_t n = read( fd, data + *len, cap - *len );
+    if ( n < 0 )
+    {
+      free( data );
+      return 0;
+    }
+    if ( n == 0 )
+      return data;
+    *len += n;
+  }
+}
+
+int tb_open( struct textbuf* tb, int fd )
+{
+  tb_init( tb );
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 )
+    return -1;
+
+  if ( S_ISREG( st.st_mode ) && st.st_size > 0 )
+  {
+    void* img = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( img != MAP_FAILED )
+    {
+      tb->img = img;
+      tb->img_len = st.st_size;
+      tb->img_mapped = true;
+    }
+  }
+  if ( ! tb->img_mapped )
+  {
+    int64_t len;
+    char* data = read_all( fd, &len );
+    if ( ! data )
+      return -1;
+    tb->img = data;
+    tb->img_len = len;
+  }
+  tb->complete = false;
+  return 0;
+}
+
+int tb_detach( struct textbuf* tb )
+{
+  tb_index_all( tb );
+  if ( ! tb->img_mapped || tb->img_private )
+    return 0;
+  // Truncating the file takes even the copied pages from a private mapping,
+  // so put anonymous memory with a copy of the image at the same address.
+  // A trigram index still being built would read it meanwhile.
+  if ( tb->trigrams && ! trigram_ready( tb->trigrams ) )
+  {
+    trigram_free( tb->trigrams );
+    tb->trigrams = 0;
+  }
+  char* copy = malloc( tb->img_len );
+  if ( ! copy )
+    return -1;
+  memcpy( copy, tb->img, tb->img_len );
+  void* img = mmap( (void*) tb->img, tb->img_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0 );
+  if ( img == MAP_FAILED )
+  {
+    free( copy );
+    return -1;
+  }
+  memcpy( img, copy, tb->img_len );
+  free( copy );
+  mprotect( img, tb->img_len, PROT_READ );
+  tb->img_private = true;
+  return 0;
+}
+
+// view of the line from p to the newline at nl
+static struct line view_line( const char* p, const char* nl )
+{
+  int64_t len = nl - p;
+  enum line_eol eol = EOL_LF;
+  // because windowz files are special snowflakes
+  if ( len > 0 && p[len-1] == '\r' )
+  {
+    --len;
+    eol = EOL_CRLF;
+  }
+  if ( len > LINE_MAX_LEN )
+    errx( EX_DATAERR, "line longer than %u bytes", LINE_MAX_LEN );
+  return line_view( p, len, eol );
+}
+
+// view of the last line, empty if the file ends with a newline
+static void index_last_line( struct textbuf* tb, struct line* l )
+{
+  int64_t len = tb->img_len - tb->img_pos;
+  if ( len > LINE_MAX_LEN )
+    errx( EX_DATAERR, "line longer than %u bytes", LINE_MAX_LEN );
+  *l = line_view( tb->img + tb->img_pos, len, EOL_NONE );
+  tb->img_pos = tb->img_len;
+  tb->complete = true;
+}
+
+// split the next n lines off the image, used without loader
+static void index_lines( struct textbuf* tb, int64_t n )
+{
+  const char* end = tb->img + tb->img_len;
+  struct line batch[TB_LEAF_MAX];
+  while ( n > 0 && ! tb->complete )
+  {
+    int k = 0;
+    for ( ; k < TB_LEAF_MAX && k < n && ! tb->complete; ++k )
+    {
+      const char* p = tb->img + tb->img_pos;
+      const char* nl = simd_memchr( p, '\n', end - p );
+      if ( nl )
+      {
+        batch[k] = view_line( p, nl );
+        tb->img_pos = nl + 1 - tb->img;
+      }
+      else
+        index_last_line( tb, &batch[k] );
+    }
+    tb_append_lines( tb, batch, k );
+    n -= k;
+  }
+}
+
+// move up to budget published lines into the tree
+static void loader_pull( struct textbuf* tb, int64_t budget )
+{
+  struct tb_loader* ld = tb->loader;
+  // read done first: if it is set, published is final
+  bool done = atomic_load( &ld->done );
+  int64_t avail = atomic_load( &ld->published );
+  struct line batch[TB_LEAF_MAX];
+  while ( ld->pulled < avail && budget > 0 )
+  {
+    int k = 0;
+    for ( ; k < TB_LEAF_MAX && ld->pulled < avail; ++k, ++ld->pulled )
+    {
+      int64_t** block = &ld->blocks[ld->pulled / TB_LOAD_BLOCK];
+      const char* nl = tb->img + (*block)[ld->pulled % TB_LOAD_BLOCK];
+      batch[k] = view_line( tb->img + tb->img_pos, nl );
+      tb->img_pos = nl + 1 - tb->img;
+      if ( ld->pulled % TB_LOAD_BLOCK == TB_LOAD_BLOCK - 1 )
+      {
+        free( *block );
+        *block = 0;
+      }
+    }
+    tb_append_lines( tb, batch, k );
+    budget -= k;
+  }
+  if ( done && ld->pulled == avail )
+  {
+    struct line l;
+    index_last_line( tb, &l );
+    tb_append_lines( tb, &l, 1 );
+    loader_free( tb );
+  }
+}
+
+void tb_load_async( struct textbuf* tb )
+{
+  if ( tb->complete || tb->loader )
+    return;
+  if ( tb->img_len - tb->img_pos < TB_PARALLEL_MIN )
+  {
+    tb_index_all( tb );
+    return;
+  }
+  tb->loader = loader_new( tb );
+  tb->loader->has_thread = pthread_create( &tb->loader->thread, 0, loader_main, tb->loader ) == 0;
+  if ( ! tb->loader->has_thread )
+    loader_main( tb->loader ); //< load in the foreground then
+}
+
+void tb_index_trigrams( struct textbuf* tb, int fd, const char* path )
+{
+  if ( tb->trigrams || tb->img_len < TB_TRIGRAM_MIN )
+    return;
+  struct stat st;
+  int64_t mtime = 0;
+  if ( fstat( fd, &st ) != 0 || st.st_size != tb->img_len )
+    path = 0; //< changed since it was read, the index is for this image only
+  else
+  {
+#ifdef __APPLE__
+    mtime = st.st_mtimespec.tv_sec * (int64_t) 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    mtime = st.st_mtim.tv_sec * (int64_t) 1000000000 + st.st_mtim.tv_nsec;
+#endif
+  }
+  tb->trigrams = trigram_start( tb->img, tb->img_len, path, mtime );
+}
+
+void tb_poll( struct textbuf* tb )
+{
+  if ( tb->loader )
+    loader_pull( tb, TB_POLL_BUDGET );
+}
+
+double tb_load_progress( const struct textbuf* tb )
+{
+  if ( tb->complete )
+    return 1;
+  if ( ! tb->loader )
+    return (double) tb->img_pos / tb->img_len;
+  return (double) atomic_load( &tb->loader->scanned ) / tb->img_len;
+}
+
+bool tb_ensure_lines( struct textbuf* tb, int64_t n )
+{
+  if ( tb->loader )
+    tb_poll( tb );
+  else if ( tb->size < n && ! tb->complete )
+  {
+    // index ahead a little so scrolling does not come back for every line
+    index_lines( tb, n - tb->size + 1024 );
+  }
+  return tb->size >= n;
+}
+
+bool tb_wait_lines( struct textbuf* tb, int64_t n )
+{
+  while ( ! tb_ensure_lines( tb, n ) && ! tb->complete )
+  {
+    struct tb_loader* ld = tb->loader;
+    pthread_mutex_lock( &ld->mtx );
+    while ( atomic_load( &ld->published ) == ld->pulled && ! atomic_load( &ld->done ) )
+      pthread_cond_wait( &ld->cond, &ld->mtx );
+    pthread_mutex_unlock( &ld->mtx );
+  }
+  return tb->size >= n;
+}
+
+void tb_index_all( struct textbuf* tb )
+{
+  if ( tb->complete )
+    return;
+  if ( ! tb->loader && tb->img_len - tb->img_pos >= TB_PARALLEL_MIN )
+  {
+    // large rest: scan it with all cores right here
+    tb->loader = loader_new( tb );
+    loader_main( tb->loader );
+  }
+  while ( tb->loader )
+  {
+    tb_wait_lines( tb, tb->size + 1 );
+    if ( tb->loader )
+      loader_pull( tb, INT64_MAX );
+  }
+  while ( ! tb->complete )
+    index_lines( tb, 1 << 16 );
+}
+
+//// iteration
+
+void tb_iter_at( const struct textbuf* tb, int64_t r, struct tb_iter* it )
+{
+  if ( r < 0 || r >= tb->size )
+  {
+    it->leaf = 0;
+    it->idx = 0;
+    return;
+  }
+  it->leaf = find_leaf( tb, &r );
+  it->idx = r;
+}
+
+const struct line* tb_iter_line( const struct tb_iter* it )
+{
+  assert( it->leaf && it->idx < it->leaf->n );
+  return &it->leaf->u.lf.line[it->idx];
+}
+
+void tb_iter_next( struct tb_iter* it )
+{
+  if ( ++it->idx < it->leaf->n )
+    return;
+  it->leaf = it->leaf->u.lf.next;
+  it->idx = 0;
+}
+
+void tb_iter_prev( struct tb_iter* it )
+{
+  if ( --it->idx >= 0 )
+    return;
+  it->leaf = it->leaf->u.lf.prev;
+  it->idx = it->leaf ? it->leaf->n - 1 : 0;
+}
+
+void tb_iter_run( struct tb_iter* it, int64_t max, int64_t max_lines, struct tb_run* run )
+{
+  const struct line* l = tb_iter_line( it );
+  run->p = line_data( l );
+  run->nlines = 1;
+  tb_iter_next( it );
+  while ( line_is_view( l ) && tb_iter_valid( it ) && line_data( l ) + line_len( l ) - run->p < max
+          && run->nlines < max_lines )
+  {
+    struct tb_node* lf = it->leaf;
+    const struct line* next = &lf->u.lf.line[it->idx];
+    if ( ! views_adjacent( l, next ) )
+      break;
+    if ( lf->u.lf.contig && run->nlines + lf->n - it->idx <= max_lines )
+    {
+      // the rest of the leaf in one step
+      l = &lf->u.lf.line[lf->n-1];
+      run->nlines += lf->n - it->idx;
+      it->leaf = lf->u.lf.next;
+      it->idx = 0;
+    }
+    else
+    {
+      l = next;
+      ++run->nlines;
+      tb_iter_next( it );
+    }
+  }
+  run->len = line_data( l ) + line_len( l ) - run->p;
+}
+
+void tb_iter_run_back( struct tb_iter* it, int64_t max, int64_t max_lines, struct tb_run* run )
+{
+  const struct line* last = tb_iter_line( it );
+  const struct line* l = last;
+  run->nlines = 1;
+  tb_iter_prev( it );
+  while ( line_is_view( l ) && tb_iter_valid( it ) && line_data( last ) + line_len( last ) - line_data( l ) < max
+          && run->nlines < max_lines )
+  {
+    struct tb_node* lf = it->leaf;
+    const struct line* prev = &lf->u.lf.line[it->idx];
+    if ( ! views_adjacent( prev, l ) )
+      break;
+    if ( lf->u.lf.contig && run->nlines + it->idx + 1 <= max_lines )
+    {
+      // the start of the leaf in one step
+      l = &lf->u.lf.line[0];
+      run->nlines += it->idx + 1;
+      it->leaf = lf->u.lf.prev;
+      it->idx = it->leaf ? it->leaf->n - 1 : 0;
+    }
+    else
+    {
+      l = prev;
+      ++run->nlines;
+      tb_iter_prev( it );
+    }
+  }
+  run->p = line_data( l );
+  run->len = line_data( last ) + line_len( last ) - run->p;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "arena.h"
+
+// Line storage of a buffer.
+//
+// Lines are kept in the leaves of a counted B+-tree: every inner node knows
+// how many lines live below each of its children, so looking up, inserting
+// or removing line r is O(log n) in the number of lines instead of a memmove
+// over a flat pointer array.  Leaves are linked to their neighbours, so
+// walking a range of lines with a tb_iter is O(1) per line.
+//
+// Each line is a struct line record stored by value in its leaf.  The record
+// caches the length, so nothing has to scan the text with strlen, and keeps
+// the line ending apart from the text.  The buffer owns the line data: it is
+// allocated from the buffer's arena and freed by tb_remove_lines() and
+// tb_free().  Tree nodes live in the arena too, so tb_free() releases a
+// buffer in O(number of arena chunks) without walking the lines.
+//
+// Short lines are stored inside the record itself, small string
+// optimization style: up to LINE_INLINE bytes need no allocation and the
+// 24 byte record is all such a line costs.  A line moves to the arena when
+// it grows beyond that.  So the text of a short line lives inside the tree
+// and line_data() is only valid as long as the record.
+//
+// A buffer opened with tb_open() is backed by a read-only memory image of the
+// file.  Its lines are views into the image (cap == 0) and are only copied
+// into the record or the arena by line_reserve() the first time they are
+// edited.  The line index is built lazily: lines are split off the image
+// when somebody asks for them with tb_ensure_lines(), or by a background
+// loader thread started with tb_load_async() whose lines are moved into the
+// tree by tb_poll().
+
+#define TB_LEAF_MAX 64 //< lines per leaf
+#define TB_NODE_MAX 32 //< children per inner node
+
+#define LINE_INLINE 22          //< longest line stored inside the record
+#define LINE_MAX_LEN 0xfffffff0u //< longest line, fits struct line::ext.cap after rounding
+#define LINE_EXT 0xff           //< struct line::ilen of lines stored outside the record
+
+// line ending of a line, the last line of a file usually has none
+// The values are the number of bytes of the line ending.
+enum line_eol
+{
+  EOL_NONE,
+  EOL_LF,
+  EOL_CRLF
+};
+
+// Use the accessors below instead of the fields.  A zero initialized record
+// is an empty line.
+struct line
+{
+  union __attribute__((packed))
+  {
+    struct __attribute__((packed))
+    {
+      char* data;   //< from the buffer's arena or view into the file image, not NUL terminated
+      uint32_t len; //< without line ending
+      uint32_t cap; //< allocated bytes of data, 0 for views
+    } ext;
+    char in[LINE_INLINE]; //< text of an inline line
+  } u;
+  uint8_t ilen; //< length of an inline line, LINE_EXT otherwise
+  uint8_t eol;  //< enum line_eol
+} __attribute__((aligned(8)));
+
+static inline bool line_is_inline( const struct line* l ) { return l->ilen != LINE_EXT; }
+// a view must not be written to, see line_reserve()
+static inline bool line_is_view( const struct line* l ) { return ! line_is_inline( l ) && l->u.ext.cap == 0; }
+
+// length without line ending
+static inline int64_t line_len( const struct line* l ) { return line_is_inline( l ) ? l->ilen : l->u.ext.len; }
+// text of the line, not NUL terminated
+static inline const char* line_data( const struct line* l ) { return line_is_inline( l ) ? l->u.in : l->u.ext.data; }
+
+static inline int line_eol_len( const struct line* l ) { return l->eol; }
+static inline const char* line_eol_str( const struct line* l ) { return l->eol == EOL_CRLF ? "\r\n" : "\n"; }
+
+// view of the len bytes at p, len <= LINE_MAX_LEN
+static inline struct line line_view( const char* p, int64_t len, enum line_eol eol )
+{
+  struct line l;
+  l.u.ext.data = (char*) p;
+  l.u.ext.len = len;
+  l.u.ext.cap = 0;
+  l.ilen = LINE_EXT;
+  l.eol = eol;
+  return l;
+}
+
+// cut the line after len bytes, the storage is kept
+static inline void line_truncate( struct line* l, int64_t len )
+{
+  if ( line_is_inline( l ) )
+    l->ilen = len;
+  else
+    l->u.ext.len = len;
+}
+
+struct textbuf;
+struct tb_node;
+struct tb_loader;
+struct trigram_index;
+
+// The line functions allocate from the arena of tb, the line must belong to
+// tb or be inserted into it.
+
+// make room for at least cap bytes, growing geometrically
+// A view is copied into the record or the arena, so the line is writable
+// afterwards.
+void line_reserve( struct textbuf* tb, struct line* l, int64_t cap );
+// insert n bytes of s before position pos
+void line_insert( struct textbuf* tb, struct line* l, int64_t pos, const char* s, int64_t n );
+// remove n bytes starting at pos, the allocation is kept for reuse
+void line_erase( struct textbuf* tb, struct line* l, int64_t pos, int64_t n );
+// replace the text by the n bytes at s, which must not point into the line
+// Takes at most one allocation of just the needed size.
+void line_assign( struct textbuf* tb, struct line* l, const char* s, int64_t n );
+void line_free( struct textbuf* tb, struct line* l );
+
+struct textbuf
+{
+  struct tb_node* root;
+  int64_t size; //< number of lines
+  struct arena mem;         //< line data and tree nodes
+  struct arena_pool nodes;  //< tree nodes in mem
+
+  // file image, lines are views into it
+  const char* img;
+  int64_t img_len;
+  int64_t img_pos; //< bytes of img already split into lines
+  bool img_mapped; //< img is mmap'ed, malloc'ed otherwise
+  bool img_private; //< a mapped img is a copy, no longer the file, see tb_detach()
+  bool complete;   //< all lines of img are in the tree
+  struct tb_loader* loader; //< background indexing, 0 if not running
+  struct trigram_index* trigrams; //< block filters of img for searching, 0 if not indexed
+};
+
+// position of a line in the tree, see tb_iter_at()
+struct tb_iter
+{
+  struct tb_node* leaf; //< 0 if past the end
+  int idx;
+};
+
+// consecutive lines whose text follows each other in memory, separated by
+// their line endings, see tb_iter_run()
+struct tb_run
+{
+  const char* p;  //< text of the first line
+  int64_t len;    //< bytes up to the end of the text of the last line
+  int64_t nlines;
+};
+
+void tb_init( struct textbuf* tb );
+void tb_free( struct textbuf* tb );
+
+// init tb with the content of the file fd, returns -1 and sets errno on error
+// Only the image is set up, lines are indexed on demand.
+int tb_open( struct textbuf* tb, int fd );
+// make the image independent of the file, so the file can be overwritten
+// in place: indexes all lines and puts a copy of a mapped image in place of
+// the mapping.  Returns -1 and sets errno on error.
+int tb_detach( struct textbuf* tb );
+// index the rest of the file on a background thread
+void tb_load_async( struct textbuf* tb );
+// move lines indexed by the background loader into the tree
+void tb_poll( struct textbuf* tb );
+// fraction of the file indexed so far
+double tb_load_progress( const struct textbuf* tb );
+// make sure tb has at least n lines, false if there are less
+// Indexes synchronously without loader, only takes what the loader has
+// indexed so far otherwise.
+bool tb_ensure_lines( struct textbuf* tb, int64_t n );
+// like tb_ensure_lines() but waits for the loader
+bool tb_wait_lines( struct textbuf* tb, int64_t n );
+// index all remaining lines, waits for the loader
+void tb_index_all( struct textbuf* tb );
+// build a trigram index of the image of a large file in the background,
+// see trigram.h, path 0 does not cache it
+// fd is the file the image was read from, its mtime is part of the cache key.
+void tb_index_trigrams( struct textbuf* tb, int fd, const char* path );
+
+static inline int64_t tb_size( const struct textbuf* tb ) { return tb->size; }
+
+// line r, 0 <= r < tb_size()
+// The record lives inside the tree and is only valid until the next
+// tb_insert_line() or tb_remove_lines().
+const struct line* tb_line( const struct textbuf* tb, int64_t r );
+// line r for modification
+struct line* tb_line_mut( struct textbuf* tb, int64_t r );
+
+// insert l as new line r, 0 <= r <= tb_size(), the buffer takes ownership of its storage
+void tb_insert_line( struct textbuf* tb, int64_t r, const struct line* l );
+// insert the n lines at l as lines r .. r+n-1, the buffer takes ownership of their storage
+// Appending goes through tb_append_lines(), otherwise the leaf holding line
+// r is split there and the lines go between its parts into packed leaves,
+// which are linked into the parents all at once.
+void tb_insert_lines( struct textbuf* tb, int64_t r, const struct line* l, int64_t n );
+// append n lines, the buffer takes ownership of their storage
+void tb_append_lines( struct textbuf* tb, const struct line* l, int64_t n );
+// remove and free n lines starting at line r
+void tb_remove_lines( struct textbuf* tb, int64_t r, int64_t n );
+
+// iterator at line r, invalid if r is out of range
+void tb_iter_at( const struct textbuf* tb, int64_t r, struct tb_iter* it );
+static inline bool tb_iter_valid( const struct tb_iter* it ) { return it->leaf != 0; }
+const struct line* tb_iter_line( const struct tb_iter* it );
+void tb_iter_next( struct tb_iter* it );
+void tb_iter_prev( struct tb_iter* it );
+// the run of lines starting at the valid iterator it, it is moved past it
+// Unedited lines that follow each other in the file image form one run of
+// about max bytes and at most max_lines lines, leaves that were never edited
+// are taken in one step.  Any other line is a run of its own.
+void tb_iter_run( struct tb_iter* it, int64_t max, int64_t max_lines, struct tb_run* run );
+// like tb_iter_run() but for the run of lines ending at it, it is moved before it
+void tb_iter_run_back( struct tb_iter* it, int64_t max, int64_t max_lines, struct tb_run* run );
@@ -0,0 +1,354 @@
+#define _DEFAULT_SOURCE //< mkstemp, realpath
+
+#include "trigram.h"
+#include "parallel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <err.h>
+#include <sysexits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define TRIGRAM_WORDS (TRIGRAM_BITS / 64) //< uint64_t per block filter
+#define TRIGRAM_MAGIC "deetri1"
+
+struct trigram_index
+{
+  const char* img;
+  int64_t len;
+  char* path;    //< 0 if not cached
+  int64_t mtime;
+
+  int64_t nblocks;
+  const int64_t* starts;    //< image offset of each block, nblocks+1 entries
+  const uint64_t* filters;  //< TRIGRAM_WORDS per block
+  int64_t* own;             //< starts and filters if built, 0 if mapped
+  void* map;                //< the cache file if loaded from it
+  size_t map_len;
+
+  atomic_bool ready;
+  atomic_bool cancel;
+  bool has_thread;
+  pthread_t thread;
+};
+
+// the cache file starts with this, followed by the path padded to 8 bytes,
+// the block starts and the filters
+struct cache_header
+{
+  char magic[8];
+  int64_t size;
+  int64_t mtime;
+  int64_t block;
+  int64_t bits;
+  int64_t nblocks;
+  int64_t path_len;
+};
+
+static inline uint32_t fold_char( unsigned char c )
+{
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// bit of the trigram t (3 folded bytes) in a block filter
+static inline uint32_t trigram_bit( uint32_t t )
+{
+  return (uint32_t) (t * 2654435761u) >> (32 - __builtin_ctz( TRIGRAM_BITS ));
+}
+
+static inline bool filter_has( const uint64_t* f, uint32_t bit )
+{
+  return f[bit / 64] >> (bit % 64) & 1;
+}
+
+//// cache file
+
+static int64_t align8( int64_t n )
+{
+  return (n + 7) & ~(int64_t) 7;
+}
+
+static int64_t cache_size( int64_t path_len, int64_t nblocks )
+{
+  return sizeof(struct cache_header) + align8( path_len ) + (nblocks + 1) * sizeof(int64_t)
+    + nblocks * TRIGRAM_WORDS * sizeof(uint64_t);
+}
+
+// dir/sub exists or was created and is writable
+static bool usable_dir( char* out, size_t n, const char* dir, const char* sub )
+{
+  if ( ! dir || ! *dir )
+    return false;
+  if ( snprintf( out, n, "%s%s", dir, sub ) >= (int) n )
+    return false;
+  mkdir( out, 0700 );
+  return access( out, W_OK | X_OK ) == 0;
+}
+
+static bool cache_dir( char* out, size_t n )
+{
+  if ( usable_dir( out, n, getenv( "XDG_CACHE_HOME" ), "/deemacs" ) )
+    return true;
+  const char* home = getenv( "HOME" );
+  char dot_cache[4096];
+  if ( home && *home && snprintf( dot_cache, sizeof(dot_cache), "%s/.cache", home ) < (int) sizeof(dot_cache) )
+  {
+    mkdir( dot_cache, 0700 );
+    if ( usable_dir( out, n, dot_cache, "/deemacs" ) )
+      return true;
+  }
+  return false; //< not in a shared directory like /tmp, others could plant a cache there
+}
+
+// cache file of the index, named after a hash of the path
+static bool cache_file( const struct trigram_index* ix, char* out, size_t n )
+{
+  char dir[4096];
+  if ( ! cache_dir( dir, sizeof(dir) ) )
+    return false;
+  uint64_t h = 14695981039346656037u; // FNV-1a
+  for ( const char* p = ix->path; *p; ++p )
+    h = (h ^ (unsigned char) *p) * 1099511628211u;
+  return snprintf( out, n, "%s/deemacs-%016" PRIx64 ".tri", dir, h ) < (int) n;
+}
+
+static bool cache_load( struct trigram_index* ix )
+{
+  char name[4096];
+  if ( ! cache_file( ix, name, sizeof(name) ) )
+    return false;
+  int fd = open( name, O_RDONLY );
+  if ( fd < 0 )
+    return false;
+  struct stat st;
+  void* map = MAP_FAILED;
+  // only a cache nobody else can change, it is mapped shared
+  if ( fstat( fd, &st ) == 0 && st.st_size >= (off_t) sizeof(struct cache_header)
+       && st.st_uid == getuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0 )
+    map = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED )
+    return false;
+
+  // a different file of the same name or an older format is just rebuilt
+  const struct cache_header* h = map;
+  int64_t path_len = strlen( ix->path );
+  int64_t nblocks = (ix->len + TRIGRAM_BLOCK - 1) / TRIGRAM_BLOCK;
+  if ( memcmp( h->magic, TRIGRAM_MAGIC, sizeof(h->magic) ) != 0 || h->size != ix->len || h->mtime != ix->mtime
+       || h->block != TRIGRAM_BLOCK || h->bits != TRIGRAM_BITS || h->nblocks != nblocks || h->path_len != path_len
+       || st.st_size != cache_size( path_len, nblocks )
+       || memcmp( (const char*) (h + 1), ix->path, path_len ) != 0 )
+  {
+    munmap( map, st.st_size );
+    return false;
+  }
+  // the block starts are used as offsets into the image, a damaged cache
+  // must not make them point outside of it or skip blocks
+  const int64_t* starts = (const int64_t*) ((const char*) (h + 1) + align8( path_len ));
+  bool valid = starts[0] == 0 && starts[nblocks] == ix->len;
+  for ( int64_t k = 0; valid && k < nblocks; ++k )
+    valid = starts[k] <= starts[k + 1];
+  if ( ! valid )
+  {
+    munmap( map, st.st_size );
+    return false;
+  }
+  ix->map = map;
+  ix->map_len = st.st_size;
+  ix->nblocks = nblocks;
+  ix->starts = starts;
+  ix->filters = (const uint64_t*) (ix->starts + nblocks + 1);
+  return true;
+}
+
+static bool write_all( int fd, const void* p, int64_t n )
+{
+  while ( n > 0 )
+  {
+    ssize_t k = write( fd, p, n );
+    if ( k <= 0 )
+      return false;
+    p = (const char*) p + k;
+    n -= k;
+  }
+  return true;
+}
+
+// write to a temporary file first, so nobody maps a half written cache
+static void cache_save( const struct trigram_index* ix )
+{
+  char name[4096];
+  char tmp_name[4096 + 16];
+  if ( ! cache_file( ix, name, sizeof(name) ) )
+    return;
+  snprintf( tmp_name, sizeof(tmp_name), "%s.XXXXXX", name );
+  int fd = mkstemp( tmp_name );
+  if ( fd < 0 )
+    return;
+
+  struct cache_header h;
+  memset( &h, 0, sizeof(h) );
+  memcpy( h.magic, TRIGRAM_MAGIC, sizeof(h.magic) );
+  h.size = ix->len;
+  h.mtime = ix->mtime;
+  h.block = TRIGRAM_BLOCK;
+  h.bits = TRIGRAM_BITS;
+  h.nblocks = ix->nblocks;
+  h.path_len = strlen( ix->path );
+  static const char pad[8];
+  bool ok = write_all( fd, &h, sizeof(h) )
+    && write_all( fd, ix->path, h.path_len )
+    && write_all( fd, pad, align8( h.path_len ) - h.path_len )
+    && write_all( fd, ix->starts, (ix->nblocks + 1) * sizeof(int64_t) )
+    && write_all( fd, ix->filters, ix->nblocks * TRIGRAM_WORDS * sizeof(uint64_t) );
+  if ( close( fd ) != 0 )
+    ok = false;
+  if ( ! ok || rename( tmp_name, name ) != 0 )
+    unlink( tmp_name );
+}
+
+//// building
+
+static void build_block( void* ctx, int64_t k )
+{
+  struct trigram_index* ix = ctx;
+  if ( atomic_load( &ix->cancel ) )
+    return;
+  uint64_t* f = (uint64_t*) ix->filters + k * TRIGRAM_WORDS;
+  const unsigned char* p = (const unsigned char*) ix->img + ix->starts[k];
+  const unsigned char* end = (const unsigned char*) ix->img + ix->starts[k+1];
+  // trigrams never span a line ending, needles do not contain one
+  uint32_t t = 0;
+  int valid = 0;
+  for ( ; p < end; ++p )
+  {
+    if ( *p == '\n' )
+    {
+      valid = 0;
+      continue;
+    }
+    t = (t << 8 | fold_char( *p )) & 0xffffff;
+    if ( ++valid >= 3 )
+    {
+      uint32_t bit = trigram_bit( t );
+      f[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    }
+  }
+}
+
+static void build( struct trigram_index* ix )
+{
+  ix->nblocks = (ix->len + TRIGRAM_BLOCK - 1) / TRIGRAM_BLOCK;
+  ix->own = calloc( (ix->nblocks + 1) + ix->nblocks * TRIGRAM_WORDS, sizeof(int64_t) );
+  if ( ! ix->own ) err( EX_OSERR, NULL );
+  int64_t* starts = ix->own;
+  ix->starts = starts;
+  ix->filters = (const uint64_t*) (starts + ix->nblocks + 1);
+
+  // a block ends behind the first line ending at or after its nominal end,
+  // so every line is inside one block
+  starts[0] = 0;
+  for ( int64_t k = 1; k < ix->nblocks; ++k )
+  {
+    int64_t from = k * TRIGRAM_BLOCK - 1;
+    if ( from < starts[k-1] )
+      from = starts[k-1];
+    const char* nl = memchr( ix->img + from, '\n', ix->len - from );
+    starts[k] = nl ? nl + 1 - ix->img : ix->len;
+  }
+  starts[ix->nblocks] = ix->len;
+
+  parallel_for( ix->nblocks, build_block, ix );
+}
+
+static void* trigram_main( void* arg )
+{
+  struct trigram_index* ix = arg;
+  if ( ix->path && cache_load( ix ) )
+  {
+    atomic_store( &ix->ready, true );
+    return 0;
+  }
+  build( ix );
+  if ( atomic_load( &ix->cancel ) )
+    return 0;
+  atomic_store( &ix->ready, true );
+  if ( ix->path )
+    cache_save( ix );
+  return 0;
+}
+
+struct trigram_index* trigram_start( const char* img, int64_t len, const char* path, int64_t mtime )
+{
+  struct trigram_index* ix = calloc( 1, sizeof(struct trigram_index) );
+  if ( ! ix ) err( EX_OSERR, NULL );
+  ix->img = img;
+  ix->len = len;
+  ix->mtime = mtime;
+  if ( path )
+    ix->path = realpath( path, 0 ); //< the same file opened by different paths shares a cache, not cached if that fails
+  atomic_init( &ix->ready, false );
+  atomic_init( &ix->cancel, false );
+  ix->has_thread = pthread_create( &ix->thread, 0, trigram_main, ix ) == 0;
+  if ( ! ix->has_thread )
+    trigram_main( ix ); //< build in the foreground then
+  return ix;
+}
+
+bool trigram_ready( const struct trigram_index* ix )
+{
+  return atomic_load( &ix->ready );
+}
+
+// the filter of block k has all trigrams of the needle
+static bool block_may_contain( const struct trigram_index* ix, int64_t k, const char* needle, int64_t len )
+{
+  const uint64_t* f = ix->filters + k * TRIGRAM_WORDS;
+  uint32_t t = fold_char( needle[0] ) << 8 | fold_char( needle[1] );
+  for ( int64_t i = 2; i < len; ++i )
+  {
+    t = (t << 8 | fold_char( needle[i] )) & 0xffffff;
+    if ( ! filter_has( f, trigram_bit( t ) ) )
+      return false;
+  }
+  return true;
+}
+
+bool trigram_may_contain( const struct trigram_index* ix, const char* p, int64_t n, const char* needle, int64_t len )
+{
+  if ( len < 3 || ! trigram_ready( ix ) || ix->nblocks == 0 || p < ix->img || p + n > ix->img + ix->len )
+    return true;
+  int64_t off = p - ix->img;
+  int64_t k = off / TRIGRAM_BLOCK;
+  if ( k >= ix->nblocks )
+    k = ix->nblocks - 1;
+  while ( ix->starts[k] > off )
+    --k;
+  for ( ; k < ix->nblocks && ix->starts[k] < off + n; ++k )
+  {
+    if ( block_may_contain( ix, k, needle, len ) )
+      return true;
+  }
+  return false;
+}
+
+void trigram_free( struct trigram_index* ix )
+{
+  if ( ! ix )
+    return;
+  atomic_store( &ix->cancel, true );
+  if ( ix->has_thread && pthread_join( ix->thread, 0 ) != 0 )
+    err( EX_OSERR, NULL );
+  if ( ix->map )
+    munmap( ix->map, ix->map_len );
+  free( ix->own );
+  free( ix->path );
+  free( ix );
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Trigram index of a file image.
+//
+// The image is cut into blocks of about TRIGRAM_BLOCK bytes that end at line
+// boundaries.  For each block a bloom filter of TRIGRAM_BITS bits records
+// the trigrams of its lines, ASCII folded to lower case.  A needle can only
+// match in a block whose filter has all trigrams of the needle, so a search
+// skips the other blocks without reading them.  Needles shorter than three
+// bytes can not be filtered.
+//
+// The index is built on all cores by a background thread and written to a
+// sidecar cache file keyed by the path, size and modification time of the
+// file.  Opening the same unchanged file again maps the cache instead of
+// reading the whole image.  The cache lives in $XDG_CACHE_HOME/deemacs or
+// ~/.cache/deemacs, never in a directory shared with other users.  A cache
+// that can not be read or written only costs the rebuild.
+
+#define TRIGRAM_BLOCK (1 << 18) //< bytes per block, blocks are extended to the end of their last line
+#define TRIGRAM_BITS (1 << 16)  //< bits per block filter
+
+struct trigram_index;
+
+// index the len bytes at img in the background
+// path and mtime (ns) identify the file in the cache, path is resolved with
+// realpath(), with path 0 nothing is cached.  img must stay valid until trigram_free().
+struct trigram_index* trigram_start( const char* img, int64_t len, const char* path, int64_t mtime );
+// the index is built or loaded and used by trigram_may_contain()
+bool trigram_ready( const struct trigram_index* ix );
+// false if no line in the n bytes at p can contain the needle of len bytes
+// True if the index is not ready yet or p is not inside the image.
+bool trigram_may_contain( const struct trigram_index* ix, const char* p, int64_t n, const char* needle, int64_t len );
+// stop building and free the index
+void trigram_free( struct trigram_index* ix );